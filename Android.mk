@@ -17,7 +17,7 @@ os := $(shell echo $(shell uname -s) | tr '[:upper:]' '[:lower:]')
 LOCAL_PATH:= $(call my-dir)
 include $(CLEAR_VARS)
 
-LOCAL_SRC_FILES := torrentd.cpp httpd.cpp \
+LOCAL_SRC_FILES := torrentd.cpp httpd.cpp availability.cpp container.cpp piececache.cpp metrics.cpp blocklist.cpp log.cpp streaming_plugin.cpp request.cpp streaming.cpp sendrange.cpp \
 	$(REPO_TOP_DIR)/native/libtorrent-android-builder/libtorrent/deps/try_signal/signal_error_code.cpp \
 	$(REPO_TOP_DIR)/native/libtorrent-android-builder/libtorrent/deps/try_signal/try_signal.cpp \
 
@@ -31,6 +31,9 @@ LOCAL_LDLIBS += $(REPO_TOP_DIR)/native/openssl-android-builder/dist-$(TARGET_ARC
 
 LOCAL_LDLIBS += -latomic
 
+# Evicting pieces to honor -b uses libtorrent internals, which the static library above exports
+# LOCAL_CFLAGS += -DTORRENTD_EVICTION
+
 LOCAL_CPPFLAGS += -fexceptions
 LOCAL_CPPFLAGS += -frtti
 
@@ -0,0 +1,97 @@
+// Copyright 2017 Archos SA
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "availability.h"
+
+Availability::Availability(long long offset, long long fileSize, int pieceLength) :
+	_offset(offset), _fileSize(fileSize), _pieceLength(pieceLength) {
+	_firstPiece = offset / pieceLength;
+	_lastPiece = fileSize ? (offset + fileSize - 1) / pieceLength : _firstPiece;
+}
+
+void Availability::add(int piece) {
+	if(piece < _firstPiece || piece > _lastPiece || has(piece))
+		return;
+
+	int start = piece;
+	int end = piece + 1;
+
+	//Merge with the run ending right before us
+	auto it = _runs.lower_bound(piece);
+	if(it != _runs.begin()) {
+		auto prev = it;
+		--prev;
+		if(prev->second == piece) {
+			start = prev->first;
+			_runs.erase(prev);
+		}
+	}
+
+	//Merge with the run starting right after us
+	it = _runs.find(end);
+	if(it != _runs.end()) {
+		end = it->second;
+		_runs.erase(it);
+	}
+
+	_runs[start] = end;
+}
+
+void Availability::remove(int piece) {
+	auto it = _runs.upper_bound(piece);
+	if(it == _runs.begin())
+		return;
+	--it;
+	if(it->second <= piece)
+		return;
+
+	int start = it->first;
+	int end = it->second;
+	_runs.erase(it);
+	if(start < piece)
+		_runs[start] = piece;
+	if(piece + 1 < end)
+		_runs[piece + 1] = end;
+}
+
+bool Availability::has(int piece) const {
+	auto it = _runs.upper_bound(piece);
+	if(it == _runs.begin())
+		return false;
+	--it;
+	return it->second > piece;
+}
+
+long long Availability::available(long long off, long long size) const {
+	if(off < 0 || off >= _fileSize)
+		return 0;
+
+	int piece = (off + _offset) / _pieceLength;
+	auto it = _runs.upper_bound(piece);
+	if(it == _runs.begin())
+		return 0;
+	--it;
+	if(it->second <= piece)
+		return 0;
+
+	//End of the run, relative to the file
+	long long end = (long long)it->second * _pieceLength - _offset;
+	if(end > _fileSize)
+		end = _fileSize;
+
+	long long res = end - off;
+	if(res > size)
+		res = size;
+	return res;
+}
@@ -0,0 +1,43 @@
+// Copyright 2017 Archos SA
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef AVAILABILITY_H
+#define AVAILABILITY_H
+
+#include <map>
+
+//Verified pieces of one file, stored as runs of contiguous pieces
+//so that "how much can I read from here" is a single lookup
+class Availability {
+	private:
+		long long _offset;
+		long long _fileSize;
+		int _pieceLength;
+		int _firstPiece, _lastPiece;
+		//First piece of a run -> one past its last piece
+		std::map<int, int> _runs;
+	public:
+		//offset is where the file starts in the torrent
+		Availability(long long offset, long long fileSize, int pieceLength);
+
+		//Pieces are numbered torrent-wide, pieces outside of the file are ignored
+		void add(int piece);
+		void remove(int piece);
+		bool has(int piece) const;
+
+		//Number of bytes that can be read from off (file-relative), up to size
+		long long available(long long off, long long size) const;
+};
+
+#endif
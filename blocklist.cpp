@@ -0,0 +1,212 @@
+// Copyright 2017 Archos SA
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <string>
+#include "blocklist.h"
+#include "log.h"
+
+//Cache layout, native endianness since it never leaves the device:
+//magic, version, source mtime, source size, source path length, number of ranges, source path, ranges
+static const char cacheMagic[4] = { 'T', 'D', 'B', 'L' };
+static const uint32_t cacheVersion = 2;
+
+struct CacheHeader {
+	char magic[4];
+	uint32_t version;
+	int64_t mtime;
+	int64_t size;
+	//Another list with the same mtime and size must not reuse it
+	uint32_t pathLength;
+	uint32_t count;
+};
+
+//Parses a dotted quad at p, not going past end
+static const char *parseAddress(const char *p, const char *end, uint32_t& addr) {
+	addr = 0;
+	for(int i = 0; i < 4; ++i) {
+		if(i) {
+			if(p == end || *p != '.')
+				return NULL;
+			p++;
+		}
+		int digits = 0;
+		uint32_t byte = 0;
+		while(p != end && *p >= '0' && *p <= '9' && digits < 3) {
+			byte = byte * 10 + (*p - '0');
+			p++;
+			digits++;
+		}
+		if(!digits || byte > 255)
+			return NULL;
+		addr = (addr << 8) | byte;
+	}
+	return p;
+}
+
+static const char *skipSpaces(const char *p, const char *end) {
+	while(p != end && (*p == ' ' || *p == '\t'))
+		p++;
+	return p;
+}
+
+//Range is after the last ':' of the line, descriptions may contain some too
+static bool parseLine(const char *line, const char *end, std::pair<uint32_t, uint32_t>& range) {
+	const char *colon = NULL;
+	for(const char *p = end; p != line; --p) {
+		if(p[-1] == ':') {
+			colon = p;
+			break;
+		}
+	}
+	if(!colon)
+		return false;
+
+	const char *p = parseAddress(skipSpaces(colon, end), end, range.first);
+	if(!p)
+		return false;
+	p = skipSpaces(p, end);
+	if(p == end || *p != '-')
+		return false;
+	p = parseAddress(skipSpaces(p + 1, end), end, range.second);
+	return p && range.first <= range.second;
+}
+
+static void parseBlocklist(const char *data, size_t size, IpRanges& ranges) {
+	const char *end = data + size;
+	const char *line = data;
+	while(line < end) {
+		const char *eol = (const char*)memchr(line, '\n', end - line);
+		if(!eol)
+			eol = end;
+		const char *lineEnd = eol;
+		if(lineEnd != line && lineEnd[-1] == '\r')
+			lineEnd--;
+
+		std::pair<uint32_t, uint32_t> range;
+		if(lineEnd != line && *line != '#' && parseLine(line, lineEnd, range))
+			ranges.push_back(range);
+		line = eol + 1;
+	}
+}
+
+static void mergeRanges(IpRanges& ranges) {
+	if(ranges.empty())
+		return;
+	std::sort(ranges.begin(), ranges.end());
+
+	size_t last = 0;
+	for(size_t i = 1; i < ranges.size(); ++i) {
+		//Overlapping or adjacent, the +1 can't overflow since then last would already cover everything
+		if(ranges[last].second == 0xffffffff || ranges[i].first <= ranges[last].second + 1) {
+			ranges[last].second = std::max(ranges[last].second, ranges[i].second);
+		} else {
+			ranges[++last] = ranges[i];
+		}
+	}
+	ranges.resize(last + 1);
+}
+
+static bool readCache(const char *cachePath, const std::string& path, const struct stat& source, IpRanges& ranges) {
+	int fd = open(cachePath, O_RDONLY|O_CLOEXEC);
+	if(fd == -1)
+		return false;
+
+	CacheHeader header;
+	bool ok = read(fd, &header, sizeof(header)) == sizeof(header) &&
+		!memcmp(header.magic, cacheMagic, sizeof(cacheMagic)) &&
+		header.version == cacheVersion &&
+		header.mtime == (int64_t)source.st_mtime &&
+		header.size == (int64_t)source.st_size &&
+		header.pathLength == path.size();
+	if(ok) {
+		std::string cachedPath(header.pathLength, '\0');
+		ok = !path.size() || (read(fd, &cachedPath[0], path.size()) == (ssize_t)path.size() && cachedPath == path);
+	}
+	if(ok) {
+		ranges.resize(header.count);
+		size_t bytes = header.count * sizeof(ranges[0]);
+		ok = !bytes || read(fd, &ranges[0], bytes) == (ssize_t)bytes;
+	}
+	close(fd);
+	if(!ok)
+		ranges.clear();
+	return ok;
+}
+
+//Written aside then renamed, so that a reader never sees half a cache
+static void writeCache(const char *cachePath, const std::string& path, const struct stat& source, const IpRanges& ranges) {
+	std::string tmp = std::string(cachePath) + ".tmp";
+	int fd = open(tmp.c_str(), O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+	if(fd == -1)
+		return;
+
+	CacheHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, cacheMagic, sizeof(cacheMagic));
+	header.version = cacheVersion;
+	header.mtime = source.st_mtime;
+	header.size = source.st_size;
+	header.pathLength = path.size();
+	header.count = ranges.size();
+	size_t bytes = ranges.size() * sizeof(ranges[0]);
+
+	bool ok = write(fd, &header, sizeof(header)) == sizeof(header) &&
+		write(fd, path.data(), path.size()) == (ssize_t)path.size() &&
+		(!bytes || write(fd, &ranges[0], bytes) == (ssize_t)bytes);
+	close(fd);
+	if(!ok || rename(tmp.c_str(), cachePath) != 0)
+		unlink(tmp.c_str());
+}
+
+bool loadBlocklist(const char *path, const char *cachePath, IpRanges& ranges) {
+	ranges.clear();
+	int fd = open(path, O_RDONLY|O_CLOEXEC);
+	if(fd == -1)
+		return false;
+	struct stat st;
+	if(fstat(fd, &st) == -1) {
+		close(fd);
+		return false;
+	}
+
+	if(readCache(cachePath, path, st, ranges)) {
+		close(fd);
+		return true;
+	}
+
+	if(st.st_size > 0) {
+		void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(data == MAP_FAILED) {
+			LOGE("mmap %s: %s", path, strerror(errno));
+			close(fd);
+			return false;
+		}
+		madvise(data, st.st_size, MADV_SEQUENTIAL);
+		parseBlocklist((const char*)data, st.st_size, ranges);
+		munmap(data, st.st_size);
+	}
+	close(fd);
+
+	mergeRanges(ranges);
+	writeCache(cachePath, path, st, ranges);
+	return true;
+}
@@ -0,0 +1,29 @@
+// Copyright 2017 Archos SA
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef BLOCKLIST_H
+#define BLOCKLIST_H
+
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+//IPv4 ranges to block, both ends included, in host byte order
+typedef std::vector<std::pair<uint32_t, uint32_t> > IpRanges;
+
+//Reads a P2P format blocklist, one "description:1.2.3.0-1.2.3.255" per line
+//Ranges come out sorted and merged. They are saved to cachePath, which is used
+//instead of parsing the list again as long as the list's path, mtime and size don't change
+bool loadBlocklist(const char *path, const char *cachePath, IpRanges& ranges);
+
+#endif
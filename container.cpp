@@ -0,0 +1,503 @@
+// Copyright 2017 Archos SA
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "container.h"
+
+//Enough for an mp4 box header with 64bits size, or an mkv element ID + size
+static const int maxHeaderSize = 16;
+//We don't expect a SeekHead bigger than that
+static const long long maxSeekHeadSize = 64*1024;
+//Top level elements/boxes we are willing to walk through before giving up
+static const int maxSteps = 64;
+//Biggest Cues or moov we load to list keyframes
+static const long long maxIndexSize = 32*1024*1024;
+//Cues only tell where a keyframe's cluster starts, assume it fits in that
+static const long long mkvKeyframeSize = 256*1024;
+
+static const uint32_t ebmlId = 0x1A45DFA3;
+static const uint32_t segmentId = 0x18538067;
+static const uint32_t seekHeadId = 0x114D9B74;
+static const uint32_t seekId = 0x4DBB;
+static const uint32_t seekIdId = 0x53AB;
+static const uint32_t seekPositionId = 0x53AC;
+static const uint32_t cuesId = 0x1C53BB6B;
+static const uint32_t clusterId = 0x1F43B675;
+static const uint32_t cuePointId = 0xBB;
+static const uint32_t cueTrackPositionsId = 0xB7;
+static const uint32_t cueClusterPositionId = 0xF1;
+
+enum ReadStatus {
+	READ_OK,
+	READ_MISSING,
+	READ_INVALID,
+};
+
+static uint64_t readBE(const uint8_t *p, int len) {
+	uint64_t res = 0;
+	for(int i = 0; i < len; ++i)
+		res = (res << 8) | p[i];
+	return res;
+}
+
+//Reads at most len bytes at off, clamped to file size
+static bool readAt(ContainerReader& read, long long fileSize, long long off, uint8_t *buf, int& len) {
+	if(off >= fileSize)
+		return false;
+	if(off + len > fileSize)
+		len = fileSize - off;
+	return read(off, buf, len);
+}
+
+//EBML variable size integer
+//Returns its length, or 0 if invalid. unknown is set for "all ones" sizes
+static int ebmlVint(const uint8_t *p, int avail, bool keepMarker, uint64_t& value, bool& unknown) {
+	if(avail < 1 || !p[0])
+		return 0;
+	int len = 1;
+	uint8_t mask = 0x80;
+	while(!(p[0] & mask)) {
+		mask >>= 1;
+		len++;
+	}
+	if(len > avail)
+		return 0;
+
+	value = keepMarker ? p[0] : (p[0] & (mask - 1));
+	bool allOnes = (p[0] & (mask - 1)) == (mask - 1);
+	for(int i = 1; i < len; ++i) {
+		value = (value << 8) | p[i];
+		allOnes = allOnes && p[i] == 0xff;
+	}
+	unknown = !keepMarker && allOnes;
+	return len;
+}
+
+static ReadStatus readEbmlHeader(ContainerReader& read, long long fileSize, long long off,
+		uint32_t& id, long long& size, int& headerSize) {
+	uint8_t buf[maxHeaderSize];
+	int len = 12;
+	if(!readAt(read, fileSize, off, buf, len))
+		return off >= fileSize ? READ_INVALID : READ_MISSING;
+
+	uint64_t value;
+	bool unknown;
+	int idLen = ebmlVint(buf, len, true, value, unknown);
+	if(!idLen || idLen > 4)
+		return READ_INVALID;
+	id = value;
+	int sizeLen = ebmlVint(buf + idLen, len - idLen, false, value, unknown);
+	if(!sizeLen)
+		return READ_INVALID;
+	headerSize = idLen + sizeLen;
+	size = unknown ? fileSize - off - headerSize : (long long)value;
+	return READ_OK;
+}
+
+//Parses SeekHead content, returns the segment-relative positions of Cues and of another SeekHead
+static void parseSeekHead(const uint8_t *p, int len, long long& cues, long long& seekHead) {
+	int pos = 0;
+	while(pos < len) {
+		uint64_t id, size;
+		bool unknown;
+		int idLen = ebmlVint(p + pos, len - pos, true, id, unknown);
+		if(!idLen)
+			return;
+		int sizeLen = ebmlVint(p + pos + idLen, len - pos - idLen, false, size, unknown);
+		if(!sizeLen || unknown || (long long)size > len - pos - idLen - sizeLen)
+			return;
+		const uint8_t *body = p + pos + idLen + sizeLen;
+		pos += idLen + sizeLen + size;
+		if(id != seekId)
+			continue;
+
+		//Seek content: SeekID + SeekPosition
+		uint64_t targetId = 0, position = 0;
+		bool hasPosition = false;
+		int spos = 0;
+		while(spos < (int)size) {
+			uint64_t cid, csize;
+			int cidLen = ebmlVint(body + spos, size - spos, true, cid, unknown);
+			if(!cidLen)
+				break;
+			int csizeLen = ebmlVint(body + spos + cidLen, size - spos - cidLen, false, csize, unknown);
+			if(!csizeLen || unknown || csize > 8 || (long long)csize > (long long)size - spos - cidLen - csizeLen)
+				break;
+			const uint8_t *cbody = body + spos + cidLen + csizeLen;
+			if(cid == seekIdId) {
+				targetId = readBE(cbody, csize);
+			} else if(cid == seekPositionId) {
+				position = readBE(cbody, csize);
+				hasPosition = true;
+			}
+			spos += cidLen + csizeLen + csize;
+		}
+		if(!hasPosition)
+			continue;
+		if(targetId == cuesId)
+			cues = position;
+		else if(targetId == seekHeadId)
+			seekHead = position;
+	}
+}
+
+static bool findMkvIndex(long long fileSize, ContainerReader& read, IndexSearch& res) {
+	uint32_t id;
+	long long size;
+	int headerSize;
+	ReadStatus status = readEbmlHeader(read, fileSize, 0, id, size, headerSize);
+	if(status == READ_MISSING) {
+		res.wanted.push_back(std::make_pair(0LL, (long long)maxHeaderSize));
+		return true;
+	}
+	if(status != READ_OK || id != ebmlId)
+		return false;
+
+	long long off = headerSize + size;
+	status = readEbmlHeader(read, fileSize, off, id, size, headerSize);
+	if(status == READ_MISSING) {
+		res.wanted.push_back(std::make_pair(off, off + maxHeaderSize));
+		return true;
+	}
+	if(status != READ_OK || id != segmentId) {
+		res.done = true;
+		return true;
+	}
+	long long segmentStart = off + headerSize;
+
+	//Walk top-level elements of the Segment, jumping where SeekHeads tell us to
+	long long pos = segmentStart;
+	for(int step = 0; step < maxSteps; ++step) {
+		status = readEbmlHeader(read, fileSize, pos, id, size, headerSize);
+		if(status == READ_MISSING) {
+			res.wanted.push_back(std::make_pair(pos, pos + maxHeaderSize));
+			return true;
+		}
+		if(status != READ_OK)
+			break;
+
+		long long end = std::min(pos + headerSize + size, fileSize);
+		if(id == cuesId) {
+			res.wanted.push_back(std::make_pair(pos, end));
+			res.done = true;
+			return true;
+		}
+
+		if(id == seekHeadId && size <= maxSeekHeadSize) {
+			res.wanted.push_back(std::make_pair(pos, end));
+			std::vector<uint8_t> buf(size);
+			int len = size;
+			if(!readAt(read, fileSize, pos + headerSize, buf.data(), len))
+				return true;
+
+			long long cues = -1, seekHead = -1;
+			parseSeekHead(buf.data(), len, cues, seekHead);
+			if(cues >= 0) {
+				pos = segmentStart + cues;
+				continue;
+			}
+			if(seekHead >= 0 && segmentStart + seekHead != pos) {
+				pos = segmentStart + seekHead;
+				continue;
+			}
+		}
+
+		//Walking through clusters would mean fetching the whole file, let the caller guess
+		if(id == clusterId)
+			break;
+
+		pos = end;
+		if(pos >= fileSize)
+			break;
+	}
+
+	res.done = true;
+	return true;
+}
+
+static bool findMp4Index(long long fileSize, ContainerReader& read, IndexSearch& res) {
+	long long pos = 0;
+	for(int step = 0; step < maxSteps && pos < fileSize; ++step) {
+		uint8_t buf[maxHeaderSize];
+		int len = maxHeaderSize;
+		if(!readAt(read, fileSize, pos, buf, len)) {
+			res.wanted.push_back(std::make_pair(pos, pos + maxHeaderSize));
+			return true;
+		}
+		if(len < 8)
+			break;
+
+		long long size = readBE(buf, 4);
+		int headerSize = 8;
+		if(size == 1) {
+			if(len < 16)
+				break;
+			size = readBE(buf + 8, 8);
+			headerSize = 16;
+		} else if(size == 0) {
+			size = fileSize - pos;
+		}
+
+		if(pos == 0 && memcmp(buf + 4, "ftyp", 4))
+			return false;
+		if(size < headerSize)
+			break;
+
+		if(!memcmp(buf + 4, "moov", 4)) {
+			res.wanted.push_back(std::make_pair(pos, std::min(pos + size, fileSize)));
+			res.done = true;
+			return true;
+		}
+		pos += size;
+	}
+
+	res.done = true;
+	return true;
+}
+
+IndexSearch findContainerIndex(long long fileSize, ContainerReader read) {
+	IndexSearch res;
+	res.done = false;
+
+	//Until the first bytes are there, we don't know the format
+	uint8_t buf[8];
+	int len = sizeof(buf);
+	if(!readAt(read, fileSize, 0, buf, len)) {
+		res.wanted.push_back(std::make_pair(0LL, (long long)maxHeaderSize));
+		return res;
+	}
+
+	if(findMp4Index(fileSize, read, res))
+		return res;
+	res.wanted.clear();
+	if(findMkvIndex(fileSize, read, res))
+		return res;
+
+	res.wanted.clear();
+	res.done = true;
+	return res;
+}
+
+//Loads [first, second[ entirely, false if it's too big or not downloaded
+static bool readRange(ContainerReader& read, long long fileSize, std::pair<long long, long long> range, std::vector<uint8_t>& buf) {
+	long long size = std::min(range.second, fileSize) - range.first;
+	if(size <= 0 || size > maxIndexSize)
+		return false;
+	buf.resize(size);
+	int len = size;
+	return readAt(read, fileSize, range.first, buf.data(), len) && len == size;
+}
+
+//Calls f(id, body, size) for each child element of an mkv master element
+template<typename F>
+static void forEachEbmlChild(const uint8_t *p, long long len, F f) {
+	long long pos = 0;
+	while(pos < len) {
+		uint64_t id, size;
+		bool unknown;
+		int idLen = ebmlVint(p + pos, len - pos, true, id, unknown);
+		if(!idLen)
+			return;
+		int sizeLen = ebmlVint(p + pos + idLen, len - pos - idLen, false, size, unknown);
+		if(!sizeLen || unknown || (long long)size > len - pos - idLen - sizeLen)
+			return;
+		f(id, p + pos + idLen + sizeLen, (long long)size);
+		pos += idLen + sizeLen + size;
+	}
+}
+
+static void findMkvKeyframes(long long fileSize, ContainerReader& read, const IndexSearch& index,
+		std::vector<std::pair<long long, long long> >& res) {
+	//findMkvIndex ends its search with the Cues element
+	if(index.wanted.empty())
+		return;
+	auto cues = index.wanted.back();
+	uint32_t id;
+	long long size;
+	int cuesHeaderSize, headerSize;
+	if(readEbmlHeader(read, fileSize, cues.first, id, size, cuesHeaderSize) != READ_OK || id != cuesId)
+		return;
+
+	//Cue positions are relative to the Segment's data
+	if(readEbmlHeader(read, fileSize, 0, id, size, headerSize) != READ_OK)
+		return;
+	long long segmentStart = headerSize + size;
+	if(readEbmlHeader(read, fileSize, segmentStart, id, size, headerSize) != READ_OK || id != segmentId)
+		return;
+	segmentStart += headerSize;
+
+	std::vector<uint8_t> buf;
+	if(!readRange(read, fileSize, std::make_pair(cues.first + cuesHeaderSize, cues.second), buf))
+		return;
+
+	//CuePoint > CueTrackPositions > CueClusterPosition
+	forEachEbmlChild(buf.data(), buf.size(), [&](uint64_t pointId, const uint8_t *point, long long pointSize) {
+		if(pointId != cuePointId)
+			return;
+		forEachEbmlChild(point, pointSize, [&](uint64_t trackId, const uint8_t *track, long long trackSize) {
+			if(trackId != cueTrackPositionsId)
+				return;
+			forEachEbmlChild(track, trackSize, [&](uint64_t posId, const uint8_t *pos, long long posSize) {
+				if(posId != cueClusterPositionId || posSize > 8)
+					return;
+				long long off = segmentStart + readBE(pos, posSize);
+				if(off < fileSize)
+					res.push_back(std::make_pair(off, std::min(off + mkvKeyframeSize, fileSize)));
+			});
+		});
+	});
+	//Several tracks may point to the same cluster
+	std::sort(res.begin(), res.end());
+	res.erase(std::unique(res.begin(), res.end()), res.end());
+}
+
+//Finds a child box of an mp4 container box, returns its body or NULL
+static const uint8_t *findBox(const uint8_t *p, long long len, const char *type, long long& bodySize) {
+	long long pos = 0;
+	while(pos + 8 <= len) {
+		long long size = readBE(p + pos, 4);
+		int headerSize = 8;
+		if(size == 1) {
+			if(pos + 16 > len)
+				return NULL;
+			size = readBE(p + pos + 8, 8);
+			headerSize = 16;
+		} else if(size == 0) {
+			size = len - pos;
+		}
+		if(size < headerSize || size > len - pos)
+			return NULL;
+		if(!memcmp(p + pos + 4, type, 4)) {
+			bodySize = size - headerSize;
+			return p + pos + headerSize;
+		}
+		pos += size;
+	}
+	return NULL;
+}
+
+//Body of a full box (version + flags) with its entry count, NULL if it can't hold count entries of entrySize
+static const uint8_t *tableBox(const uint8_t *stbl, long long stblSize, const char *type, int headerSize, int entrySize, uint32_t& count) {
+	long long size;
+	const uint8_t *p = findBox(stbl, stblSize, type, size);
+	if(!p || size < headerSize)
+		return NULL;
+	count = readBE(p + headerSize - 4, 4);
+	if((long long)count * entrySize > size - headerSize)
+		return NULL;
+	return p + headerSize;
+}
+
+static void findMp4Keyframes(long long fileSize, ContainerReader& read, const IndexSearch& index,
+		std::vector<std::pair<long long, long long> >& res) {
+	//findMp4Index only wants the moov
+	if(index.wanted.size() != 1)
+		return;
+	std::vector<uint8_t> moov;
+	if(!readRange(read, fileSize, index.wanted[0], moov) || moov.size() < 8 || memcmp(moov.data() + 4, "moov", 4))
+		return;
+	long long moovSize;
+	const uint8_t *p = findBox(moov.data(), moov.size(), "moov", moovSize);
+	if(!p)
+		return;
+
+	//First video track
+	const uint8_t *stbl = NULL;
+	long long stblSize = 0;
+	long long pos = 0;
+	while(!stbl && pos < moovSize) {
+		long long trakSize;
+		const uint8_t *trak = findBox(p + pos, moovSize - pos, "trak", trakSize);
+		if(!trak)
+			return;
+		pos = trak + trakSize - p;
+		long long mdiaSize, hdlrSize, minfSize;
+		const uint8_t *mdia = findBox(trak, trakSize, "mdia", mdiaSize);
+		const uint8_t *hdlr = mdia ? findBox(mdia, mdiaSize, "hdlr", hdlrSize) : NULL;
+		if(!hdlr || hdlrSize < 12 || memcmp(hdlr + 8, "vide", 4))
+			continue;
+		const uint8_t *minf = findBox(mdia, mdiaSize, "minf", minfSize);
+		if(minf)
+			stbl = findBox(minf, minfSize, "stbl", stblSize);
+	}
+	if(!stbl)
+		return;
+
+	//Sample sizes, chunk offsets and how samples are spread in chunks
+	uint32_t nSizes, nChunks, nStsc, nSync = 0;
+	long long stszSize;
+	const uint8_t *stsz = findBox(stbl, stblSize, "stsz", stszSize);
+	if(!stsz || stszSize < 12)
+		return;
+	uint32_t constantSize = readBE(stsz + 4, 4);
+	nSizes = readBE(stsz + 8, 4);
+	const uint8_t *sizes = stsz + 12;
+	if(!constantSize && (long long)nSizes * 4 > stszSize - 12)
+		return;
+
+	int offsetSize = 4;
+	const uint8_t *offsets = tableBox(stbl, stblSize, "stco", 8, 4, nChunks);
+	if(!offsets) {
+		offsetSize = 8;
+		offsets = tableBox(stbl, stblSize, "co64", 8, 8, nChunks);
+	}
+	const uint8_t *stsc = tableBox(stbl, stblSize, "stsc", 8, 12, nStsc);
+	if(!offsets || !stsc || !nStsc)
+		return;
+	//No stss: every sample is a sync sample
+	const uint8_t *sync = tableBox(stbl, stblSize, "stss", 8, 4, nSync);
+
+	//Walk chunks and their samples once, sync sample numbers are sorted
+	uint32_t sample = 1;
+	uint32_t nextSync = 0;
+	for(uint32_t chunk = 1, entry = 0; chunk <= nChunks && sample <= nSizes; ++chunk) {
+		while(entry + 1 < nStsc && readBE(stsc + (entry + 1) * 12, 4) <= chunk)
+			entry++;
+		uint32_t perChunk = readBE(stsc + entry * 12 + 4, 4);
+		long long off = readBE(offsets + (chunk - 1) * offsetSize, offsetSize);
+		for(uint32_t j = 0; j < perChunk && sample <= nSizes; ++j, ++sample) {
+			long long size = constantSize ? constantSize : readBE(sizes + (sample - 1) * 4, 4);
+			bool isSync = !sync;
+			while(sync && nextSync < nSync && readBE(sync + nextSync * 4, 4) < sample)
+				nextSync++;
+			if(sync && nextSync < nSync && readBE(sync + nextSync * 4, 4) == sample)
+				isSync = true;
+			if(isSync && off + size <= fileSize)
+				res.push_back(std::make_pair(off, off + size));
+			off += size;
+		}
+	}
+	std::sort(res.begin(), res.end());
+}
+
+std::vector<std::pair<long long, long long> > findKeyframes(long long fileSize, ContainerReader read) {
+	std::vector<std::pair<long long, long long> > res;
+	IndexSearch index = findContainerIndex(fileSize, read);
+	if(!index.done || index.wanted.empty())
+		return res;
+
+	uint8_t buf[8];
+	int len = sizeof(buf);
+	if(!readAt(read, fileSize, 0, buf, len) || len < 8)
+		return res;
+	if(!memcmp(buf + 4, "ftyp", 4))
+		findMp4Keyframes(fileSize, read, index, res);
+	else
+		findMkvKeyframes(fileSize, read, index, res);
+	return res;
+}
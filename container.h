@@ -0,0 +1,41 @@
+// Copyright 2017 Archos SA
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef CONTAINER_H
+#define CONTAINER_H
+
+#include <functional>
+#include <utility>
+#include <vector>
+
+//Reads len bytes at file offset off into buf
+//Returns false when those bytes aren't downloaded yet
+typedef std::function<bool (long long off, void *buf, int len)> ContainerReader;
+
+struct IndexSearch {
+	//File ranges [first, second[ holding the index (mp4 moov, mkv SeekHead/Cues),
+	//or holding the next header we need to read to find it
+	std::vector<std::pair<long long, long long> > wanted;
+	//Nothing more to learn by parsing again: either the index is located, or the format is unknown
+	bool done;
+};
+
+//Walks mp4 boxes or mkv elements as far as downloaded data allows
+IndexSearch findContainerIndex(long long fileSize, ContainerReader read);
+
+//File ranges [first, second[ of keyframes, in file order: mkv Cues clusters, or sync samples of the first mp4 video track
+//The index must be downloaded (see findContainerIndex), empty when it's not or the format is unknown
+std::vector<std::pair<long long, long long> > findKeyframes(long long fileSize, ContainerReader read);
+
+#endif
@@ -21,373 +21,1185 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
 #include <time.h>
 #include <string.h>
+#include <strings.h>
+#include <limits.h>
 
+#include <chrono>
 #include <iostream>
 #include <vector>
+#include <algorithm>
 #include <thread>
 #include <mutex>
 #include <string>
-#include <condition_variable>
+#include <list>
+#include <functional>
 #include <unordered_map>
-#include <boost/algorithm/string.hpp>
 #include <boost/lexical_cast.hpp>
 
-class SocketHelper {
-	private:
-		int _fd;
-		uint8_t buffer[1024];
-		int _pos, _size;
-	public:
-		SocketHelper(int fd) : _fd(fd), _pos(0), _size(0) { };
-		void pop() {
-			if(_size == 0)
-				return;
-			_pos++;
-			_size--;
-			_pos%=sizeof(buffer);
-		}
+#include "availability.h"
+#include "httpd.h"
+#include "log.h"
+#include "metrics.h"
+#include "piececache.h"
+#include "request.h"
+#include "sendrange.h"
 
-		int getc() {
-			int v = next();
-			pop();
-			return v;
-		}
+//One file being served, several may come from the same torrent
+struct ServedFile {
+	std::string torrent;
+	int fileIndex;
+	//Small number identifying the torrent in cache keys
+	long long torrentSlot;
+	const char *path;
+	long long fileSize;
+	long long offset;
+	int pieceLength;
+	Availability availability;
+	std::list<StreamRange> ranges;
+	//Samples each /preview client still waits for, protected like ranges
+	std::list<std::vector<std::pair<long long, long long> > > previews;
+	//OpenSubtitles hash, once torrentd computed it
+	bool hasSubtitleHash;
+	uint64_t subtitleHash;
+	//Parsed by torrentd once the container index is there, empty until then
+	std::vector<std::pair<long long, long long> > keyframes;
+	//Set once torrentd forgot about it, connections still holding it must go
+	bool removed;
 
-		int next() {
-			if(_size==0)
-				readMore();
-			if(_size==0)
-				return -1;
-			return buffer[_pos];
-		}
+	ServedFile(const std::string& t, int index, long long slot, const char *p, long long size, long long off, int length) :
+		torrent(t), fileIndex(index), torrentSlot(slot), path(strdup(p)), fileSize(size), offset(off), pieceLength(length),
+		availability(off, size, length), hasSubtitleHash(false), subtitleHash(0), removed(false) { }
+	~ServedFile() {
+		free((void*)path);
+	}
+};
 
-		void readMore() {
-			if(_size)
-				return;
-			int n = sizeof(buffer)-_pos;
-			int got = read(_fd, &buffer[_pos], n);
-			_size += got;
-		}
+//fileInfos_l protects the list and every file's content but its ranges
+static std::mutex fileInfos_l;
+//First one is served for requests not naming a file
+static std::list<std::shared_ptr<ServedFile> > _files;
+static std::unordered_map<std::string, long long> _torrentSlots;
+//Torrents torrentd knows -> their number of files, -1 until metadata is there
+static std::unordered_map<std::string, int> _knownTorrents;
+//Files asked for over HTTP that aren't served yet, for torrentd to select
+static std::vector<std::pair<std::string, int> > _fileRequests;
+static PieceCache _cache(16*1024*1024);
 
-		std::string getLine() {
-			std::string res="";
-			while(1) {
-				int v = getc();
-				if(v == -1)
-					return res;
-
-				if(v == '\r' && next() == '\n') {
-					pop();
-					return res;
-				}
-				res += (char)v;
-			}
-		}
+//Protects every file's ranges
+static std::mutex _currentRanges_l;
+
+static long long cacheKey(long long torrentSlot, int piece) {
+	return (torrentSlot << 32) | piece;
+}
 
-		void writeString(const char *str) {
-			write(_fd, str, strlen(str));
+//Must be called with fileInfos_l held
+static std::shared_ptr<ServedFile> findFile(const std::string& torrent, int fileIndex) {
+	for(auto it = _files.begin(); it != _files.end(); ++it) {
+		if(torrent.empty() || ((*it)->torrent == torrent && (*it)->fileIndex == fileIndex))
+			return *it;
+	}
+	return NULL;
+}
+
+//Takes both locks, so it's left out of release builds
+static void dumpCurrentRanges() {
+#ifndef NDEBUG
+	std::unique_lock<std::mutex> lk(fileInfos_l);
+	std::unique_lock<std::mutex> rangesLk(_currentRanges_l);
+	LOGD("Ranges:");
+	for(auto f = _files.begin(); f != _files.end(); ++f) {
+		for(auto it = (*f)->ranges.begin(); it != (*f)->ranges.end(); ++it) {
+			LOGD("\t%s/%d %lld-%lld%s", (*f)->torrent.c_str(), (*f)->fileIndex, it->first, it->second, it->idle ? " (idle)" : "");
 		}
-};
+	}
+#endif
+}
 
-static std::unordered_map<std::string, std::string> getCommand(SocketHelper& stream) {
-	std::unordered_map<std::string, std::string> res;
-	std::string line = stream.getLine();
+//last is inclusive, like in Range and Content-Range
+static std::string giveContentLength(long long first, long long last, long long fileSize, bool partial) {
+	std::string str = "Content-Length: ";
+	str += boost::lexical_cast<std::string>(last - first + 1);
+	str += "\r\n";
+	LOGD("Add %s", str.c_str());
 
-	std::vector<std::string> strs;
-	boost::split(strs, line, boost::is_any_of("\t "));
-	if(strs.size() < 3) {
-		res["error"] = "Invalid protocol";
-		return res;
+	if(partial) {
+		str += "Content-Range: bytes ";
+		str += boost::lexical_cast<std::string>(first);
+		str += "-";
+		str += boost::lexical_cast<std::string>(last);
+		// /size
+		str += "/";
+		str += boost::lexical_cast<std::string>(fileSize);
+		str += "\r\n";
 	}
+	return str;
+}
 
-	res["method"] = strs[0];
-	res["file"] = strs[1];
+//Signaled when a range opens, jumps or closes, so that torrentd reprioritizes right away
+static int _rangesFd = -1;
 
-	return res;
+static void notifyRangesChanged() {
+	uint64_t one = 1;
+	if(_rangesFd != -1)
+		write(_rangesFd, &one, sizeof(one));
 }
 
-static std::unordered_map<std::string, std::string> getRequest(SocketHelper& stream) {
-	auto res = getCommand(stream);
-	if(res.count("error"))
-		return res;
-	while(true) {
-		std::string line = stream.getLine();
-		if(line=="")
-			return res;
-
-		const char *str = line.c_str();
-		char *key = strdup(str);
-		char *sep = strchr(key, ':');
-		if(!sep) {
-			std::cerr << "Failed to parse " << line << std::endl;
-			res["error"] = "Failed to parse header";
-			return res;
-		}
-		*sep = 0;
-		sep++;
-		if(*sep)
-			sep++;
-		res[key] = sep;
-		free(key);
-	}
-	return res;
+static std::list<StreamRange>::iterator insertRange(ServedFile& file, std::pair<long long, long long> range, long long rate) {
+	std::unique_lock<std::mutex> lk(_currentRanges_l);
+	StreamRange r = { range.first, range.second, rate, false };
+	auto it = file.ranges.insert(file.ranges.end(), r);
+	lk.unlock();
+	//Only once it's there, torrentd may wake and call getRanges() right away
+	notifyRangesChanged();
+	return it;
 }
 
-std::pair<long long,long long> parseRange(const std::string& str) {
-	auto res = std::make_pair(0LL, -1LL);
-	auto cstr = str.c_str();
+static void deleteRange(ServedFile& file, std::list<StreamRange>::iterator range) {
+	std::unique_lock<std::mutex> lk(_currentRanges_l);
+	file.ranges.erase(range);
+	lk.unlock();
+	notifyRangesChanged();
+}
 
-	if(strstr(cstr, "bytes=") != cstr)
-		return res;
+static void setPreview(ServedFile& file, std::list<std::vector<std::pair<long long, long long> > >::iterator preview,
+		const std::vector<std::pair<long long, long long> >& samples) {
+	std::unique_lock<std::mutex> lk(_currentRanges_l);
+	*preview = samples;
+	lk.unlock();
+	notifyRangesChanged();
+}
 
-	cstr += strlen("bytes=");
-	std::cerr << "cstr = " << cstr << std::endl;
+static void deletePreview(ServedFile& file, std::list<std::vector<std::pair<long long, long long> > >::iterator preview) {
+	std::unique_lock<std::mutex> lk(_currentRanges_l);
+	file.previews.erase(preview);
+	lk.unlock();
+	notifyRangesChanged();
+}
 
-	char *next = NULL;
-	res.first = strtoll(cstr, &next, 0);
-	if(!next || *next != '-')
+std::vector<std::pair<long long, long long> > getPreviews(const std::string& torrent, int fileIndex) {
+	std::vector<std::pair<long long, long long> > res;
+	std::unique_lock<std::mutex> lk(fileInfos_l);
+	auto file = findFile(torrent, fileIndex);
+	lk.unlock();
+	if(!file)
 		return res;
 
-	next++;
-	char *next2 = NULL;
-	res.second = strtoll(next, &next2, 0);
-	if(next == next2)
-		res.second = -1;
+	std::unique_lock<std::mutex> rangesLk(_currentRanges_l);
+	for(auto it = file->previews.begin(); it != file->previews.end(); ++it)
+		res.insert(res.end(), it->begin(), it->end());
+	return res;
+}
 
+std::list<StreamRange> getRanges(const std::string& torrent, int fileIndex) {
+	std::unique_lock<std::mutex> lk(fileInfos_l);
+	auto file = findFile(torrent, fileIndex);
+	lk.unlock();
+	if(!file)
+		return std::list<StreamRange>();
+
+	std::unique_lock<std::mutex> rangesLk(_currentRanges_l);
+	auto res = file->ranges;
 	return res;
 }
 
-static void giveContentLength(SocketHelper& fd, std::pair<long long, long long> range);
-static void serveFile(std::unordered_map<std::string, std::string>& request, int fd, std::pair<long long,long long> range);
-static void clientHandler(int fd) {
-	SocketHelper stream(fd);
-	auto request = getRequest(stream);
-	if(request.count("error")) {
-		stream.writeString("Protocol fail...\n\r");
-		close(fd);
+//Biggest amount of data handed to the kernel in one call
+//Big enough to amortize syscalls, small enough to keep other clients served
+static const long long sendChunk = 1024*1024;
+
+//Every client lives in a fixed slot, so memory use doesn't grow with the number of connections
+static const int maxConnections = 64;
+
+//Samples listed by /preview when the client doesn't say, and at most
+static const int defaultPreviewSamples = 20;
+static const int maxPreviewSamples = 200;
+//Bytes per sample when we don't know where keyframes are
+static const long long previewSampleBytes = 256*1024;
+
+struct Connection {
+	enum State {
+		FREE,
+		READING_REQUEST,
+		//Headers need the file size, which we don't know before the file is chosen
+		WAITING_INFOS,
+		SENDING_HEADERS,
+		SENDING_BODY,
+		//Caught up with downloaded data, waiting for setPieceAvailable() to tell us more is there
+		WAITING_DATA,
+		//Answering /preview, waiting for samples to be downloaded
+		PREVIEWING,
+		//Answering /subhash, waiting for torrentd to compute it
+		WAITING_HASH,
+	};
+	State state;
+	int fd;
+	//Requested file, empty torrent for "whatever is served"
+	std::string torrent;
+	int fileIndex;
+	std::shared_ptr<ServedFile> file;
+	char request[4096];
+	int requestSize;
+	//Bytes of request taken by the one being answered, what follows is pipelined
+	int requestConsumed;
+	bool keepAlive;
+	bool partial;
+	//torrentd was asked to select the requested file
+	bool fileRequested;
+	//Range no byte can satisfy, answered with a 416
+	bool unsatisfiable;
+	//Client shut its sending side down: it may still wait for what it asked, but won't ask for more
+	bool peerClosed;
+	std::string headers;
+	size_t headersSent;
+	//first is the next byte to send, as reported by getRanges()
+	std::pair<long long, long long> range;
+	long long end;
+	bool rangeInserted;
+	std::list<StreamRange>::iterator rangeIt;
+	//Consumption rate, measured only while we have data to send
+	long long rate;
+	long long rateBytes;
+	long long rateActiveMs;
+	std::chrono::steady_clock::time_point activeSince;
+	int fileFd;
+	int pipeFds[2];
+	//Bytes already spliced into the pipe, but not yet into the socket
+	long long pipeBytes;
+	std::chrono::steady_clock::time_point waitingSince;
+	//cacheKey() of the piece we caught up with, -1 when not waiting for one
+	long long awaitedPiece;
+	//When the first bytes of the request being answered were read
+	std::chrono::steady_clock::time_point requestSince;
+	bool bodyStarted;
+	//File ranges listed by /preview, and which of them aren't downloaded yet
+	std::vector<std::pair<long long, long long> > samples;
+	std::vector<int> pendingSamples;
+	bool previewInserted;
+	std::list<std::vector<std::pair<long long, long long> > >::iterator previewIt;
+};
+
+static Connection _connections[maxConnections];
+static int _epollFd = -1;
+static int _wakeFd = -1;
+static int _listenFd = -1;
+static bool _accepting = true;
+static int _port = 0;
+static std::chrono::steady_clock::time_point _startTime;
+
+//Counters for /metrics, only touched by the reactor thread
+static long long _requests = 0;
+static long long _bytesFromCache = 0;
+static long long _bytesFromDisk = 0;
+static long long _stalls = 0;
+static Histogram _waitMs(latencyBucketsMs());
+static Histogram _serveLatencyMs(latencyBucketsMs());
+static Histogram _ttfbMs(latencyBucketsMs());
+static Histogram _seekMs(latencyBucketsMs());
+//From start_httpd() to the first body byte ever sent, -1 until then
+static long long _firstByteMs = -1;
+
+//When pieces readers are waiting for got verified, both protected by fileInfos_l
+//cacheKey() -> number of readers waiting for it
+static std::unordered_map<long long, int> _awaitedPieces;
+static std::unordered_map<long long, std::chrono::steady_clock::time_point> _pieceArrivals;
+
+static std::mutex _sessionStats_l;
+static std::vector<SessionCounter> _sessionStats;
+
+static SendMode _sendMode = SEND_SENDFILE;
+
+static void watch(Connection& c, uint32_t events) {
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	//Level-triggered, so once seen it would keep waking us up
+	ev.events = events | (c.peerClosed ? 0 : EPOLLRDHUP);
+	ev.data.ptr = &c;
+	if(epoll_ctl(_epollFd, EPOLL_CTL_MOD, c.fd, &ev) == -1)
+		LOGE("epoll_ctl: %s", strerror(errno));
+}
+
+//Must be called with fileInfos_l held
+static void releaseAwaitedPiece(Connection& c) {
+	auto it = _awaitedPieces.find(c.awaitedPiece);
+	if(it != _awaitedPieces.end() && --it->second == 0) {
+		_awaitedPieces.erase(it);
+		_pieceArrivals.erase(c.awaitedPiece);
+	}
+	c.awaitedPiece = -1;
+}
+
+static void closeConnection(Connection& c) {
+	if(c.awaitedPiece != -1) {
+		std::unique_lock<std::mutex> lk(fileInfos_l);
+		releaseAwaitedPiece(c);
+	}
+	if(c.rangeInserted)
+		deleteRange(*c.file, c.rangeIt);
+	if(c.previewInserted)
+		deletePreview(*c.file, c.previewIt);
+	dumpCurrentRanges();
+	if(c.pipeFds[0] != -1) {
+		close(c.pipeFds[0]);
+		close(c.pipeFds[1]);
+	}
+	if(c.fileFd != -1)
+		close(c.fileFd);
+	close(c.fd);
+	c.file = NULL;
+	c.state = Connection::FREE;
+
+	if(!_accepting) {
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		epoll_ctl(_epollFd, EPOLL_CTL_ADD, _listenFd, &ev);
+		_accepting = true;
+	}
+}
+
+//Minimum amount of sending time a rate sample is computed on
+static const long long rateWindowMs = 2000;
+
+static long long elapsedMs(std::chrono::steady_clock::time_point since) {
+	return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - since).count();
+}
+
+static void accountSent(Connection& c, long long bytes) {
+	c.rateBytes += bytes;
+	long long ms = c.rateActiveMs + elapsedMs(c.activeSince);
+	if(ms < rateWindowMs)
+		return;
+
+	long long sample = c.rateBytes * 1000 / ms;
+	c.rate = c.rate ? (3 * c.rate + sample) / 4 : sample;
+	c.rateBytes = 0;
+	c.rateActiveMs = 0;
+	c.activeSince = std::chrono::steady_clock::now();
+}
+
+//Move the range seen by torrentd to where this connection is now
+//seek is set when a new request moved it, rather than sending data
+static void updateRange(Connection& c, bool seek = false) {
+	if(!c.rangeInserted) {
+		c.rangeIt = insertRange(*c.file, c.range, c.rate);
+		c.rangeInserted = true;
+		dumpCurrentRanges();
 		return;
 	}
-	std::cerr << "Request =" << std::endl;
-	for(auto it = request.begin(); it != request.end(); ++it) {
-		std::cerr << "\t" << it->first << " = " << it->second << std::endl;
+	std::unique_lock<std::mutex> lk(_currentRanges_l);
+	c.rangeIt->first = c.range.first;
+	c.rangeIt->second = c.range.second;
+	c.rangeIt->rate = c.rate;
+	bool wasIdle = c.rangeIt->idle;
+	c.rangeIt->idle = false;
+	lk.unlock();
+	if(seek || wasIdle)
+		notifyRangesChanged();
+}
+
+static void addConnectionHeaders(Connection& c) {
+	c.headers += "Server: Bittorrent2Http\r\n";
+	c.headers += c.keepAlive ? "Connection: keep-alive\r\n" : "Connection: close\r\n";
+}
+
+//Same file as the previous request on this connection: keep the fd
+static void useFile(Connection& c, std::shared_ptr<ServedFile> file) {
+	if(file == c.file)
+		return;
+	if(c.rangeInserted) {
+		deleteRange(*c.file, c.rangeIt);
+		c.rangeInserted = false;
+	}
+	if(c.fileFd != -1)
+		close(c.fileFd);
+	c.file = file;
+	c.fileFd = open(c.file->path, O_RDONLY|O_CLOEXEC);
+	if(c.fileFd == -1)
+		LOGE("Opening %s: %s", c.file->path, strerror(errno));
+}
+
+//Builds response headers once the file is known
+//Returns false if we need to wait for setFileInfos()
+static bool prepareHeaders(Connection& c) {
+	std::unique_lock<std::mutex> lk(fileInfos_l);
+	auto file = findFile(c.torrent, c.fileIndex);
+	lk.unlock();
+	if(!file)
+		return false;
+
+	useFile(c, file);
+	long long fileSize = c.file->fileSize;
+
+	//bytes=-N asks for the last N bytes
+	if(c.range.first < 0)
+		c.range.first = std::max(0LL, fileSize + c.range.first);
+	if(c.unsatisfiable || (c.range.first >= fileSize && fileSize)) {
+		c.headers = "HTTP/1.1 416 Range Not Satisfiable\r\n";
+		addConnectionHeaders(c);
+		c.headers += "Content-Range: bytes */" + boost::lexical_cast<std::string>(fileSize) + "\r\n";
+		c.headers += "Content-Length: 0\r\n";
+		c.headers += "\r\n";
+		c.end = c.range.first;
+		c.headersSent = 0;
+		return true;
 	}
-	auto range = parseRange(request["Range"]);
-	std::cerr << "Parsed range = " << range.first << ":" << range.second << std::endl;
-	if(range.first)
-		stream.writeString("HTTP/1.0 206 Partial Content\r\n");
+
+	long long last = c.range.second == -1LL || c.range.second >= fileSize ? fileSize - 1 : c.range.second;
+	c.end = last + 1;
+
+	if(c.partial)
+		c.headers = "HTTP/1.1 206 Partial Content\r\n";
 	else
-		stream.writeString("HTTP/1.0 200 OK\r\n");
-	stream.writeString("Server: Bittorrent2Http\r\n");
-	stream.writeString("Connection: close\r\n");
-	stream.writeString("Accept-Ranges: bytes\r\n");
-	giveContentLength(stream, range);
-	stream.writeString("\r\n");
+		c.headers = "HTTP/1.1 200 OK\r\n";
+	addConnectionHeaders(c);
+	c.headers += "Accept-Ranges: bytes\r\n";
+	c.headers += giveContentLength(c.range.first, last, fileSize, c.partial);
+	c.headers += "\r\n";
+	c.headersSent = 0;
+	return true;
+}
 
-	serveFile(request, fd, range);
-	close(fd);
+//Files are addressed as /<info-hash>/<file index>[/anything], any other path is the first file served
+static void parsePath(const Token& path, std::string& torrent, int& fileIndex) {
+	torrent.clear();
+	fileIndex = 0;
+
+	const char *p = path.data;
+	const char *end = p + path.size;
+	if(p == end || *p++ != '/')
+		return;
+	const char *hash = p;
+	while(p != end && ((*p >= '0' && *p <= '9') || (*p >= 'a' && *p <= 'f')))
+		p++;
+	if(p - hash != 40 || p == end || *p++ != '/')
+		return;
+	long long index;
+	if(!parseNumber(p, end, index) || (p != end && *p != '/') || index > INT_MAX)
+		return;
+	//Keeps its capacity from one request to the next, no allocation once warm
+	torrent.assign(hash, 40);
+	fileIndex = index;
 }
 
-static std::mutex fileInfos_l;
-static std::condition_variable fileInfos_v;
-static const char *_filePath = NULL;
-//static int _maxOffset = 0;
-static long long _fileSize = 0;
-static std::function<long long (long long, long long)> _availableData;
+static void notFound(Connection& c) {
+	c.headers = "HTTP/1.1 404 Not Found\r\n";
+	addConnectionHeaders(c);
+	c.headers += "Content-Length: 0\r\n";
+	c.headers += "\r\n";
+	c.headersSent = 0;
+	c.range.first = 0;
+	c.end = 0;
+	c.state = Connection::SENDING_HEADERS;
+	watch(c, EPOLLOUT);
+}
 
-static std::mutex _currentRanges_l;
-static std::list<std::pair<long long, long long> > _currentRanges;
+//The requested file isn't served: false if it never will be,
+//otherwise torrentd is asked to select it, and we wait for setFileInfos()
+static bool requestFile(Connection& c) {
+	//Whatever file the app picks, like we always did
+	if(c.torrent.empty())
+		return true;
+	std::unique_lock<std::mutex> lk(fileInfos_l);
+	auto it = _knownTorrents.find(c.torrent);
+	if(it == _knownTorrents.end() || c.fileIndex < 0 || (it->second != -1 && c.fileIndex >= it->second))
+		return false;
+	if(c.fileRequested)
+		return true;
+	c.fileRequested = true;
+	_fileRequests.push_back(std::make_pair(c.torrent, c.fileIndex));
+	lk.unlock();
+	notifyRangesChanged();
+	return true;
+}
 
-static void dumpCurrentRanges() {
-	std::unique_lock<std::mutex> lk(_currentRanges_l);
-	std::cerr << "Ranges:" << std::endl;
-	for(auto it = _currentRanges.begin(); it != _currentRanges.end(); ++it) {
-		std::cerr << "\t" << it->first << "-" << it->second << std::endl;
+static void startResponse(Connection& c) {
+	if(!prepareHeaders(c)) {
+		if(!requestFile(c)) {
+			notFound(c);
+			return;
+		}
+		c.state = Connection::WAITING_INFOS;
+		watch(c, 0);
+		return;
 	}
+	c.state = Connection::SENDING_HEADERS;
+	watch(c, EPOLLOUT);
+}
+
+//Appends a "ready" line for each sample that got downloaded, returns false if none did
+static bool checkPreview(Connection& c) {
+	ServedFile& file = *c.file;
+	bool changed = false;
+	std::unique_lock<std::mutex> lk(fileInfos_l);
+	for(auto it = c.pendingSamples.begin(); it != c.pendingSamples.end();) {
+		auto& sample = c.samples[*it];
+		if(file.availability.available(sample.first, sample.second - sample.first) < sample.second - sample.first) {
+			++it;
+			continue;
+		}
+		c.headers += "ready " + boost::lexical_cast<std::string>(*it) + "\n";
+		it = c.pendingSamples.erase(it);
+		changed = true;
+	}
+	lk.unlock();
+	if(!changed)
+		return false;
+
+	//torrentd stops fetching what's there
+	std::vector<std::pair<long long, long long> > pending;
+	for(auto it = c.pendingSamples.begin(); it != c.pendingSamples.end(); ++it)
+		pending.push_back(c.samples[*it]);
+	setPreview(file, c.previewIt, pending);
+	return true;
 }
 
-static void giveContentLength(SocketHelper& fd, std::pair<long long, long long> range) {
-	std::unique_lock<std::mutex> lk(fileInfos_l, std::defer_lock);
+//Seek previews: lists samples spread across the file, keyframes when the container index is there,
+//then tells which ones are downloaded as they get there. torrentd fetches them ahead of bulk data
+//sample <n> <offset> <length>, one per sample, then ready <n> as they get downloaded
+static void servePreview(Connection& c, long long count) {
+	c.keepAlive = false;
+	std::unique_lock<std::mutex> lk(fileInfos_l);
+	auto file = findFile(c.torrent, c.fileIndex);
+	lk.unlock();
+	if(!file) {
+		notFound(c);
+		return;
+	}
+	useFile(c, file);
+	count = std::max(1LL, std::min(count ? count : defaultPreviewSamples, (long long)maxPreviewSamples));
 
-	long long fileSize = 0;
+	ServedFile& f = *c.file;
 	lk.lock();
-	while(1) {
-		const char* filePath = _filePath;
-		//int maxOffset = _maxOffset;
-		fileSize = _fileSize;
-		if(filePath)
-			break;
-		fileInfos_v.wait(lk);
+	auto keyframes = f.keyframes;
+	lk.unlock();
+	c.samples.clear();
+	if(!keyframes.empty()) {
+		count = std::min(count, (long long)keyframes.size());
+		for(long long i = 0; i < count; ++i)
+			c.samples.push_back(keyframes[i * keyframes.size() / count]);
+	} else {
+		for(long long i = 0; i < count; ++i) {
+			long long off = f.fileSize * i / count;
+			c.samples.push_back(std::make_pair(off, std::min(off + previewSampleBytes, f.fileSize)));
+		}
 	}
+	LOGD("Preview of %s: %zu samples, %zu keyframes", f.path, c.samples.size(), keyframes.size());
+
+	c.headers = "HTTP/1.1 200 OK\r\n";
+	addConnectionHeaders(c);
+	c.headers += "Content-Type: text/plain\r\n";
+	c.headers += "\r\n";
+	c.pendingSamples.clear();
+	for(size_t i = 0; i < c.samples.size(); ++i) {
+		c.headers += "sample " + boost::lexical_cast<std::string>(i) + " " +
+			boost::lexical_cast<std::string>(c.samples[i].first) + " " +
+			boost::lexical_cast<std::string>(c.samples[i].second - c.samples[i].first) + "\n";
+		c.pendingSamples.push_back(i);
+	}
+
+	std::unique_lock<std::mutex> rangesLk(_currentRanges_l);
+	c.previewIt = f.previews.insert(f.previews.end(), c.samples);
+	rangesLk.unlock();
+	c.previewInserted = true;
+	notifyRangesChanged();
+	checkPreview(c);
+
+	c.headersSent = 0;
+	c.range.first = 0;
+	c.end = 0;
+	c.state = Connection::SENDING_HEADERS;
+	watch(c, EPOLLOUT);
+}
+
+//16 hex digits, sent as soon as torrentd computed it
+//The file gets selected like for a plain request, 404 when it doesn't exist
+static void serveSubtitleHash(Connection& c) {
+	std::unique_lock<std::mutex> lk(fileInfos_l);
+	auto file = findFile(c.torrent, c.fileIndex);
+	bool known = file && file->hasSubtitleHash;
+	uint64_t hash = known ? file->subtitleHash : 0;
 	lk.unlock();
+	//Like a plain request, only files torrentd can serve are waited for
+	if(!file && !requestFile(c)) {
+		notFound(c);
+		return;
+	}
+	if(!known) {
+		c.state = Connection::WAITING_HASH;
+		watch(c, 0);
+		return;
+	}
 
-	std::string str = "Content-Length: ";
-	long long size = 0;
-	if(range.second == -1)
-		size = fileSize - range.first;
-	else
-		size = range.second;
-	str += boost::lexical_cast<std::string>(size);
-	str += "\r\n";
-	std::cerr << "Add " << str << std::endl; 
-	fd.writeString(str.c_str());
+	char body[32];
+	int len = snprintf(body, sizeof(body), "%016llx\n", (unsigned long long)hash);
+	c.headers = "HTTP/1.1 200 OK\r\n";
+	addConnectionHeaders(c);
+	c.headers += "Content-Type: text/plain\r\n";
+	c.headers += "Content-Length: " + boost::lexical_cast<std::string>(len) + "\r\n";
+	c.headers += "\r\n";
+	c.headers.append(body, len);
+	c.headersSent = 0;
+	c.range.first = 0;
+	c.end = 0;
+	c.state = Connection::SENDING_HEADERS;
+	watch(c, EPOLLOUT);
+}
 
-	if(range.first) {
-		str = "Content-Range: bytes ";
-		//Start
-		str += boost::lexical_cast<std::string>(range.first);
-		str += "-";
-		//-End
-		if(range.second && range.second != -1)
-			str += boost::lexical_cast<std::string>(range.second);
-		else
-			str += boost::lexical_cast<std::string>(fileSize-1);
-		// /size
-		str += "/";
-		str += boost::lexical_cast<std::string>(fileSize);
-		str += "\r\n";
-		fd.writeString(str.c_str());
+//Prometheus text format, everything is already counted, so a scrape only costs formatting
+static void serveMetrics(Connection& c) {
+	std::string body;
+
+	int connections = 0;
+	for(int i = 0; i < maxConnections; ++i) {
+		if(_connections[i].state != Connection::FREE)
+			connections++;
 	}
+	long long ranges = 0;
+	{
+		std::unique_lock<std::mutex> lk(fileInfos_l);
+		std::unique_lock<std::mutex> rangesLk(_currentRanges_l);
+		for(auto f = _files.begin(); f != _files.end(); ++f)
+			for(auto it = (*f)->ranges.begin(); it != (*f)->ranges.end(); ++it)
+				ranges += !it->idle;
+	}
+	long long cacheHits, cacheMisses, cacheBytes;
+	_cache.stats(cacheHits, cacheMisses, cacheBytes);
+
+	renderMetric(body, "torrentd_http_connections", "Open HTTP connections", "gauge", connections);
+	renderMetric(body, "torrentd_http_requests_total", "HTTP requests received", "counter", _requests);
+	renderMetric(body, "torrentd_active_ranges", "Ranges being streamed, as seen by the piece scheduler", "gauge", ranges);
+	renderHeader(body, "torrentd_served_bytes_total", "Bytes sent to HTTP clients", "counter");
+	renderValue(body, "torrentd_served_bytes_total", "{source=\"cache\"}", _bytesFromCache);
+	renderValue(body, "torrentd_served_bytes_total", "{source=\"disk\"}", _bytesFromDisk);
+	renderMetric(body, "torrentd_reader_stalls_total", "Times a reader caught up with downloaded data", "counter", _stalls);
+	_waitMs.render(body, "torrentd_reader_wait_ms", "Time readers spent waiting for data");
+	_serveLatencyMs.render(body, "torrentd_piece_serve_latency_ms", "From a piece a reader waits for being verified to its first byte being sent");
+	_ttfbMs.render(body, "torrentd_time_to_first_byte_ms", "From accepting a connection to sending its first body byte");
+	_seekMs.render(body, "torrentd_seek_to_data_ms", "Time to first byte of requests starting past the beginning of the file");
+	renderMetric(body, "torrentd_startup_to_first_byte_ms", "From daemon start to the first body byte ever sent, -1 until then", "gauge", _firstByteMs);
+	renderMetric(body, "torrentd_cache_hits_total", "Piece cache hits", "counter", cacheHits);
+	renderMetric(body, "torrentd_cache_misses_total", "Piece cache misses", "counter", cacheMisses);
+	renderMetric(body, "torrentd_cache_bytes", "Bytes held by the piece cache", "gauge", cacheBytes);
+
+	{
+		std::unique_lock<std::mutex> lk(_sessionStats_l);
+		for(auto it = _sessionStats.begin(); it != _sessionStats.end(); ++it) {
+			std::string name = "libtorrent_" + it->name;
+			std::replace(name.begin(), name.end(), '.', '_');
+			renderMetric(body, name.c_str(), it->name.c_str(), it->gauge ? "gauge" : "counter", it->value);
+		}
+	}
+
+	c.headers = "HTTP/1.1 200 OK\r\n";
+	addConnectionHeaders(c);
+	c.headers += "Content-Type: text/plain; version=0.0.4\r\n";
+	c.headers += "Content-Length: " + boost::lexical_cast<std::string>(body.size()) + "\r\n";
+	c.headers += "\r\n";
+	c.headers += body;
+	c.headersSent = 0;
+	c.range.first = 0;
+	c.end = 0;
+	c.state = Connection::SENDING_HEADERS;
+	watch(c, EPOLLOUT);
 }
 
-static void insertRange(std::pair<long long, long long> range) {
-	std::unique_lock<std::mutex> lk(_currentRanges_l);
-	_currentRanges.push_back(range);
+//Paths like <prefix>[/<torrent>/<fileIndex>], rest is what follows prefix
+static bool routePrefix(const Token& path, const char *prefix, Token& rest) {
+	int prefixSize = strlen(prefix);
+	if(path.size < prefixSize || memcmp(path.data, prefix, prefixSize) ||
+			(path.size != prefixSize && path.data[prefixSize] != '/'))
+		return false;
+	rest.data = path.data + prefixSize;
+	rest.size = path.size - prefixSize;
+	return true;
 }
 
-static void deleteRange(std::pair<long long, long long> range) {
-	std::unique_lock<std::mutex> lk(_currentRanges_l);
-	for(auto it = _currentRanges.begin(); it != _currentRanges.end(); ++it) {
-		if(*it == range) {
-			_currentRanges.erase(it);
-			return;
+//Answers the first request in c.request, if it's complete
+static void parseRequest(Connection& c) {
+	void *endOfHeaders = memmem(c.request, c.requestSize, "\r\n\r\n", 4);
+	if(!endOfHeaders) {
+		if(c.requestSize == sizeof(c.request)) {
+			write(c.fd, "Protocol fail...\n\r", strlen("Protocol fail...\n\r"));
+			closeConnection(c);
+		}
+		return;
+	}
+
+	c.requestConsumed = (char*)endOfHeaders + 4 - c.request;
+	Request request;
+	if(!parseRequestHeaders(c.request, c.requestConsumed, request)) {
+		write(c.fd, "Protocol fail...\n\r", strlen("Protocol fail...\n\r"));
+		closeConnection(c);
+		return;
+	}
+	LOGD("Request =\n%.*s", c.requestConsumed, c.request);
+	c.partial = request.range.data != NULL;
+	c.fileRequested = false;
+	c.unsatisfiable = !parseRange(request.range, c.range);
+	LOGD("Parsed range = %lld:%lld", c.range.first, c.range.second);
+	//HTTP/1.1 keeps the connection unless told otherwise, HTTP/1.0 only when asked
+	if(request.version.equals("HTTP/1.1"))
+		c.keepAlive = !request.connection.iequals("close");
+	else
+		c.keepAlive = request.connection.iequals("keep-alive");
+	_requests++;
+	if(request.path.equals("/metrics")) {
+		serveMetrics(c);
+		return;
+	}
+	//Query string, only used by /preview
+	Token path = request.path;
+	Token query = { NULL, 0 };
+	const char *mark = (const char*)memchr(path.data, '?', path.size);
+	if(mark) {
+		query.data = mark + 1;
+		query.size = path.data + path.size - query.data;
+		path.size = mark - path.data;
+	}
+	Token rest;
+	if(routePrefix(path, "/subhash", rest)) {
+		parsePath(rest, c.torrent, c.fileIndex);
+		serveSubtitleHash(c);
+		return;
+	}
+	if(routePrefix(path, "/preview", rest)) {
+		parsePath(rest, c.torrent, c.fileIndex);
+		Token value;
+		long long count = 0;
+		if(queryParam(query, "n", value)) {
+			const char *p = value.data;
+			parseNumber(p, value.data + value.size, count);
 		}
+		servePreview(c, count);
+		return;
 	}
-	std::cerr << "Couldn't find range to be deleted" << std::endl;
+	parsePath(path, c.torrent, c.fileIndex);
+
+	startResponse(c);
 }
 
-std::list<std::pair<long long, long long> > getRanges() {
-	std::unique_lock<std::mutex> lk(_currentRanges_l);
-	auto res = _currentRanges;
-	return res;
+static void readRequest(Connection& c) {
+	int n = read(c.fd, c.request + c.requestSize, sizeof(c.request) - c.requestSize);
+	if(n == -1 && errno == EAGAIN)
+		return;
+	if(n <= 0) {
+		closeConnection(c);
+		return;
+	}
+	//Keep-alive idle time isn't part of the answer time
+	if(c.requestSize == 0)
+		c.requestSince = std::chrono::steady_clock::now();
+	c.requestSize += n;
+	parseRequest(c);
 }
 
-static void serveFile(std::unordered_map<std::string, std::string>& request, int fd, std::pair<long long,long long> range) {
-	long long currentOffset = range.first;
-	int file = -1;
-	std::unique_lock<std::mutex> lk(fileInfos_l, std::defer_lock);
+//Response fully sent: close, or go on with the next request on the same socket
+static void finishResponse(Connection& c) {
+	if(!c.keepAlive) {
+		closeConnection(c);
+		return;
+	}
+	if(c.state == Connection::SENDING_BODY)
+		c.rateActiveMs += elapsedMs(c.activeSince);
+	//Nobody reads there anymore, torrentd must not keep a window open for an idle socket
+	//The next request moves it, with the rate measured so far
+	if(c.rangeInserted) {
+		std::unique_lock<std::mutex> lk(_currentRanges_l);
+		c.rangeIt->idle = true;
+		lk.unlock();
+		notifyRangesChanged();
+	}
 
-	insertRange(range);
+	c.requestSize -= c.requestConsumed;
+	memmove(c.request, c.request + c.requestConsumed, c.requestSize);
+	c.requestConsumed = 0;
+	c.headers.clear();
+	c.headersSent = 0;
+	c.bodyStarted = false;
+	//A pipelined request is answered from now on, one still to come is stamped by readRequest()
+	if(c.requestSize)
+		c.requestSince = std::chrono::steady_clock::now();
+	c.state = Connection::READING_REQUEST;
+	watch(c, EPOLLIN);
+	//Pipelined requests may already be there
+	parseRequest(c);
+}
 
-	dumpCurrentRanges();
+static void sendHeaders(Connection& c) {
+	int n = write(c.fd, c.headers.c_str() + c.headersSent, c.headers.size() - c.headersSent);
+	if(n == -1 && errno == EAGAIN)
+		return;
+	if(n <= 0) {
+		LOGW("write: %s", strerror(errno));
+		closeConnection(c);
+		return;
+	}
+	c.headersSent += n;
+	if(c.headersSent < c.headers.size())
+		return;
+	//Preview responses go on as samples get downloaded
+	if(c.previewInserted && !c.pendingSamples.empty()) {
+		c.headers.clear();
+		c.headersSent = 0;
+		//Some may have arrived while we were sending
+		if(checkPreview(c))
+			return;
+		c.state = Connection::PREVIEWING;
+		watch(c, 0);
+		return;
+	}
+	//Generated responses have their body in the headers
+	if(c.range.first >= c.end) {
+		finishResponse(c);
+		return;
+	}
 
-	lk.lock();
-	while(1) {
-		const char* filePath = _filePath;
-		//int maxOffset = _maxOffset;
-		auto fileSize = _fileSize;
-		auto availableData = _availableData;
-		lk.unlock();
-		std::cerr << "File path " << filePath << std::endl;
+	c.state = Connection::SENDING_BODY;
+	c.activeSince = std::chrono::steady_clock::now();
+	updateRange(c, true);
+}
 
-		if(file == -1 && filePath) {
-			file = open(filePath, O_RDONLY);
-			perror("Opening file");
-			lseek(file, range.first, SEEK_SET);
-			perror("Seeking file");
+static void sendBody(Connection& c) {
+	long long offset = c.range.first;
+	if(c.fileFd == -1) {
+		closeConnection(c);
+		return;
+	}
+
+	ServedFile& file = *c.file;
+	std::unique_lock<std::mutex> lk(fileInfos_l);
+	long long length = file.availability.available(offset, c.end - offset);
+	lk.unlock();
+
+	if(length <= 0 && !c.pipeBytes) {
+		//Caught up with the download, sleep until more data is there
+		//Time spent waiting tells about the swarm, not about the client, keep it out of the rate
+		c.rateActiveMs += elapsedMs(c.activeSince);
+		updateRange(c);
+		dumpCurrentRanges();
+		_stalls++;
+		c.waitingSince = std::chrono::steady_clock::now();
+		if(c.awaitedPiece == -1) {
+			c.awaitedPiece = cacheKey(file.torrentSlot, (offset + file.offset) / file.pieceLength);
+			lk.lock();
+			_awaitedPieces[c.awaitedPiece]++;
+			lk.unlock();
 		}
+		c.state = Connection::WAITING_DATA;
+		watch(c, 0);
+		return;
+	}
 
-		int fail = 0;
-		//while(filePath && file != -1 && currentOffset < maxOffset && (currentOffset < range.second || range.second == -1LL)) {
-		while(filePath && file != -1 && (currentOffset < range.second || range.second == -1LL)) {
-			lseek(file, currentOffset, SEEK_SET);
-			char buffer[1024];
-			int length = availableData(currentOffset, sizeof(buffer));
-			if(!length)
-				break;
-			if(length > sizeof(buffer))
-				length = sizeof(buffer);
-			int res = read(file, buffer, length);
-			if(!res || res == -1) {
-				perror("read");
-				fail = 1;
-				break;
+	long long res;
+	int pieceSize;
+	int piece = (offset + file.offset) / file.pieceLength;
+	long long inPiece = offset + file.offset - (long long)piece * file.pieceLength;
+	std::shared_ptr<const char> data;
+	if(!c.pipeBytes)
+		data = _cache.lookup(cacheKey(file.torrentSlot, piece), pieceSize);
+	bool fromCache = data && inPiece < pieceSize;
+	if(fromCache)
+		res = write(c.fd, data.get() + inPiece, std::min(length, pieceSize - inPiece));
+	else
+		res = sendRange(c.fd, c.fileFd, offset, std::min(length, sendChunk), _sendMode, c.pipeFds, c.pipeBytes);
+	if(res == -1 && errno == EAGAIN)
+		return;
+	if(res <= 0) {
+		LOGW("send: %s", strerror(errno));
+		closeConnection(c);
+		return;
+	}
+	if(!c.bodyStarted) {
+		c.bodyStarted = true;
+		long long ms = elapsedMs(c.requestSince);
+		_ttfbMs.observe(ms);
+		//Anything not starting at 0 is the player seeking
+		if(offset > 0)
+			_seekMs.observe(ms);
+		if(_firstByteMs == -1)
+			_firstByteMs = elapsedMs(_startTime);
+	}
+	if(fromCache)
+		_bytesFromCache += res;
+	else
+		_bytesFromDisk += res;
+	if(c.awaitedPiece != -1) {
+		lk.lock();
+		auto arrival = _pieceArrivals.find(c.awaitedPiece);
+		if(arrival != _pieceArrivals.end())
+			_serveLatencyMs.observe(elapsedMs(arrival->second));
+		releaseAwaitedPiece(c);
+		lk.unlock();
+	}
+	c.range.first += res;
+	accountSent(c, res);
+	updateRange(c);
+	if(c.range.first >= c.end)
+		finishResponse(c);
+}
+
+//Called when availability changed, resumes only connections whose next byte became available
+static void wakeConnections() {
+	for(int i = 0; i < maxConnections; ++i) {
+		Connection& c = _connections[i];
+		if(c.state == Connection::WAITING_INFOS) {
+			startResponse(c);
+		} else if(c.state == Connection::WAITING_DATA) {
+			std::unique_lock<std::mutex> lk(fileInfos_l);
+			bool removed = c.file->removed;
+			long long length = c.file->availability.available(c.range.first, 1);
+			lk.unlock();
+			if(removed) {
+				closeConnection(c);
+			} else if(length > 0) {
+				_waitMs.observe(elapsedMs(c.waitingSince));
+				c.state = Connection::SENDING_BODY;
+				c.activeSince = std::chrono::steady_clock::now();
+				watch(c, EPOLLOUT);
 			}
-			int res2 = write(fd, buffer, res);
-			if(!res2 || res2 == -1) {
-				perror("write");
-				fail = 1;
-				break;
+		} else if(c.state == Connection::WAITING_HASH) {
+			serveSubtitleHash(c);
+		} else if(c.state == Connection::PREVIEWING) {
+			std::unique_lock<std::mutex> lk(fileInfos_l);
+			bool removed = c.file->removed;
+			lk.unlock();
+			if(removed) {
+				closeConnection(c);
+			} else if(checkPreview(c)) {
+				c.state = Connection::SENDING_HEADERS;
+				watch(c, EPOLLOUT);
 			}
-
-			currentOffset += res2;
 		}
-		deleteRange(range);
-		range.first = currentOffset;
-		insertRange(range);
-		dumpCurrentRanges();
+	}
+}
 
-		if(fail)
-			break;
+static void acceptConnection() {
+	struct sockaddr_in c_addr;
+	socklen_t len = sizeof(c_addr);
+	int cfd = accept4(_listenFd, (struct sockaddr*)&c_addr, &len, SOCK_NONBLOCK|SOCK_CLOEXEC);
+	if(cfd == -1)
+		return;
 
-		if(filePath && currentOffset == fileSize)
+	Connection *c = NULL;
+	for(int i = 0; i < maxConnections; ++i) {
+		if(_connections[i].state == Connection::FREE) {
+			c = &_connections[i];
 			break;
+		}
+	}
+	if(!c) {
+		close(cfd);
+		return;
+	}
 
+	c->state = Connection::READING_REQUEST;
+	c->fd = cfd;
+	c->requestSize = 0;
+	c->headers.clear();
+	c->headersSent = 0;
+	c->range = std::make_pair(0LL, -1LL);
+	c->end = 0;
+	c->rangeInserted = false;
+	c->rate = 0;
+	c->rateBytes = 0;
+	c->rateActiveMs = 0;
+	c->torrent.clear();
+	c->fileIndex = 0;
+	c->file = NULL;
+	c->fileFd = -1;
+	c->pipeFds[0] = c->pipeFds[1] = -1;
+	c->pipeBytes = 0;
+	c->awaitedPiece = -1;
+	c->requestSince = std::chrono::steady_clock::now();
+	c->requestConsumed = 0;
+	c->keepAlive = false;
+	c->partial = false;
+	c->fileRequested = false;
+	c->unsatisfiable = false;
+	c->peerClosed = false;
+	c->bodyStarted = false;
+	c->samples.clear();
+	c->pendingSamples.clear();
+	c->previewInserted = false;
 
-		std::cerr << "currentOffset = " << currentOffset
-			<< ", fileSize = " << fileSize
-			<< std::endl;
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLRDHUP;
+	ev.data.ptr = c;
+	epoll_ctl(_epollFd, EPOLL_CTL_ADD, cfd, &ev);
 
-		if(currentOffset >= range.second &&
-				range.second != -1LL)
-			break;
+	//Last free slot is taken, leave next clients in the listen backlog
+	for(int i = 0; i < maxConnections; ++i) {
+		if(_connections[i].state == Connection::FREE)
+			return;
+	}
+	epoll_ctl(_epollFd, EPOLL_CTL_DEL, _listenFd, NULL);
+	_accepting = false;
+}
 
-		lk.lock();
-		//TODO: his might lead to a case where the connection is closed
-		//But we're still waiting here
-		fileInfos_v.wait(lk);
-
-#if 1
-		//Check connection not dead
-		char c;
-		if(recv(fd, &c, 1, MSG_PEEK|MSG_DONTWAIT) < 0 && errno != EAGAIN) {
-			perror("recv");
+static void wakeReactor() {
+	uint64_t one = 1;
+	if(_wakeFd != -1)
+		write(_wakeFd, &one, sizeof(one));
+}
+
+//Start serving a file, no piece is available until setPieceAvailable() says so
+void setFileInfos(const std::string& torrent, int fileIndex, const char *filePath, long long fileSize, long long offset, int pieceLength) {
+	fileInfos_l.lock();
+
+	if(!_torrentSlots.count(torrent)) {
+		long long slot = _torrentSlots.size();
+		_torrentSlots[torrent] = slot;
+	}
+	auto file = std::make_shared<ServedFile>(torrent, fileIndex, _torrentSlots[torrent], filePath, fileSize, offset, pieceLength);
+	for(auto it = _files.begin(); it != _files.end(); ++it) {
+		if((*it)->torrent == torrent && (*it)->fileIndex == fileIndex) {
+			(*it)->removed = true;
+			_files.erase(it);
 			break;
 		}
-#endif
 	}
+	_files.push_back(file);
 
-	deleteRange(range);
+	fileInfos_l.unlock();
+	wakeReactor();
+}
 
-	dumpCurrentRanges();
-	close(file);
+void setTorrent(const std::string& torrent, int nFiles) {
+	fileInfos_l.lock();
+	_knownTorrents[torrent] = nFiles;
+	fileInfos_l.unlock();
+	//Requests for files it doesn't have can be answered now
+	wakeReactor();
+}
+
+std::vector<std::pair<std::string, int> > takeFileRequests() {
+	std::unique_lock<std::mutex> lk(fileInfos_l);
+	std::vector<std::pair<std::string, int> > res;
+	res.swap(_fileRequests);
+	return res;
 }
 
-void setFileInfos(const char *filePath, long long fileSize, std::function<long long(long long, long long)> availableData) {
+void removeFiles(const std::string& torrent) {
 	fileInfos_l.lock();
+	_knownTorrents.erase(torrent);
+	for(auto it = _files.begin(); it != _files.end();) {
+		if((*it)->torrent == torrent) {
+			(*it)->removed = true;
+			it = _files.erase(it);
+		} else {
+			++it;
+		}
+	}
+	long long slot = _torrentSlots.count(torrent) ? _torrentSlots[torrent] : -1;
+	fileInfos_l.unlock();
 
-	if(_filePath)
-		delete _filePath;
-	_filePath = strdup(filePath);
-	//_maxOffset = maxOffset;
-	_fileSize = fileSize;
-	_availableData = availableData;
+	if(slot != -1)
+		_cache.removeBetween(cacheKey(slot, 0), cacheKey(slot + 1, 0) - 1);
+	wakeReactor();
+}
 
+void setPieceAvailable(const std::string& torrent, int piece, bool available) {
+	fileInfos_l.lock();
+	long long slot = -1;
+	for(auto it = _files.begin(); it != _files.end(); ++it) {
+		if((*it)->torrent != torrent)
+			continue;
+		slot = (*it)->torrentSlot;
+		if(available)
+			(*it)->availability.add(piece);
+		else
+			(*it)->availability.remove(piece);
+	}
+	if(available && slot != -1 && _awaitedPieces.count(cacheKey(slot, piece)))
+		_pieceArrivals[cacheKey(slot, piece)] = std::chrono::steady_clock::now();
 	fileInfos_l.unlock();
-	fileInfos_v.notify_all();
+	if(slot == -1)
+		return;
+
+	if(available)
+		wakeReactor();
+	else
+		_cache.remove(cacheKey(slot, piece));
+}
+
+void setSubtitleHash(const std::string& torrent, int fileIndex, uint64_t hash) {
+	std::unique_lock<std::mutex> lk(fileInfos_l);
+	auto file = findFile(torrent, fileIndex);
+	if(!file)
+		return;
+	file->subtitleHash = hash;
+	file->hasSubtitleHash = true;
+	lk.unlock();
+	wakeReactor();
+}
+
+void setKeyframes(const std::string& torrent, int fileIndex, const std::vector<std::pair<long long, long long> >& keyframes) {
+	std::unique_lock<std::mutex> lk(fileInfos_l);
+	auto file = findFile(torrent, fileIndex);
+	if(file)
+		file->keyframes = keyframes;
+}
+
+long long availableData(const std::string& torrent, int fileIndex, long long off, long long size) {
+	std::unique_lock<std::mutex> lk(fileInfos_l);
+	auto file = findFile(torrent, fileIndex);
+	if(!file)
+		return 0;
+	return file->availability.available(off, size);
+}
+
+void setCacheSize(long long bytes) {
+	_cache.setMaxBytes(bytes);
+}
+
+void cachePiece(const std::string& torrent, int piece, std::shared_ptr<const char> data, int size) {
+	std::vector<long long> playheads;
+	std::unique_lock<std::mutex> lk(fileInfos_l);
+	if(!_torrentSlots.count(torrent))
+		return;
+	long long slot = _torrentSlots[torrent];
+	std::unique_lock<std::mutex> rangesLk(_currentRanges_l);
+	for(auto f = _files.begin(); f != _files.end(); ++f) {
+		for(auto it = (*f)->ranges.begin(); it != (*f)->ranges.end(); ++it)
+			if(!it->idle)
+				playheads.push_back(cacheKey((*f)->torrentSlot, (it->first + (*f)->offset) / (*f)->pieceLength));
+	}
+	rangesLk.unlock();
+	lk.unlock();
+
+	_cache.insert(cacheKey(slot, piece), data, size, playheads);
+}
+
+int rangesChangedFd() {
+	return _rangesFd;
+}
+
+void setSessionStats(const std::vector<SessionCounter>& counters) {
+	std::unique_lock<std::mutex> lk(_sessionStats_l);
+	_sessionStats = counters;
+}
+
+void getCacheStats(long long& hits, long long& misses, long long& bytes) {
+	_cache.stats(hits, misses, bytes);
 }
 
 static void httpd() {
-	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
 	if (fd == -1) {
-		std::cerr << "Could not create socket" << std::endl;
+		LOGE("Could not create socket");
 		return;
 	} else {
-		std::cerr << "Server started" << std::endl;
+		LOGI("Server started");
 	}
 
 	// Prepare the sockaddr_in structure
@@ -395,23 +1207,81 @@ static void httpd() {
 	s_addr.sin_family = AF_INET;
 	s_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
 	//s_addr.sin_port = htons(19992);
-	int port = 10000 + (time(NULL) % 10000);
+	int port = _port ? _port : 10000 + (time(NULL) % 10000);
 	std::cout << port << std::endl;
 	s_addr.sin_port = htons(port);
-	bind(fd, (struct sockaddr*) &s_addr, sizeof(s_addr));
-	perror("bind");
+	if(bind(fd, (struct sockaddr*) &s_addr, sizeof(s_addr)) == -1)
+		LOGE("bind: %s", strerror(errno));
 	listen(fd, 10);
+	_listenFd = fd;
 
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	epoll_ctl(_epollFd, EPOLL_CTL_ADD, _listenFd, &ev);
+	ev.data.ptr = &_wakeFd;
+	epoll_ctl(_epollFd, EPOLL_CTL_ADD, _wakeFd, &ev);
+
+	struct epoll_event events[maxConnections + 2];
 	while(1) {
-		struct sockaddr_in c_addr;
-		socklen_t len = sizeof(c_addr);
-		int cfd = accept(fd, (struct sockaddr*)&c_addr, &len);
-		std::thread clientThread(clientHandler, cfd);
-		clientThread.detach();
+		int n = epoll_wait(_epollFd, events, maxConnections + 2, -1);
+		if(n == -1) {
+			if(errno != EINTR)
+				LOGE("epoll_wait: %s", strerror(errno));
+			continue;
+		}
+
+		for(int i = 0; i < n; ++i) {
+			if(events[i].data.ptr == NULL) {
+				acceptConnection();
+				continue;
+			}
+			if(events[i].data.ptr == &_wakeFd) {
+				uint64_t count;
+				read(_wakeFd, &count, sizeof(count));
+				wakeConnections();
+				continue;
+			}
+
+			Connection& c = *(Connection*)events[i].data.ptr;
+			if(c.state == Connection::FREE)
+				continue;
+			if(events[i].events & (EPOLLHUP|EPOLLERR)) {
+				closeConnection(c);
+				continue;
+			}
+			//Between requests, readRequest() sees the EOF and closes. Otherwise it may be a half-close
+			//(curl, wget) from a client waiting for its response: a gone client makes the next write fail
+			if((events[i].events & EPOLLRDHUP) && c.state != Connection::READING_REQUEST) {
+				c.peerClosed = true;
+				c.keepAlive = false;
+				if(c.state == Connection::SENDING_HEADERS || c.state == Connection::SENDING_BODY)
+					watch(c, EPOLLOUT);
+				else
+					watch(c, 0);
+			}
+			if(c.state == Connection::READING_REQUEST && (events[i].events & EPOLLIN))
+				readRequest(c);
+			else if(c.state == Connection::SENDING_HEADERS && (events[i].events & EPOLLOUT))
+				sendHeaders(c);
+			else if(c.state == Connection::SENDING_BODY && (events[i].events & EPOLLOUT))
+				sendBody(c);
+		}
 	}
 }
 
-void start_httpd() {
+void start_httpd(int port) {
+	_port = port;
+	_startTime = std::chrono::steady_clock::now();
+	_epollFd = epoll_create1(EPOLL_CLOEXEC);
+	_wakeFd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	_rangesFd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	if(_epollFd == -1 || _wakeFd == -1 || _rangesFd == -1) {
+		LOGE("epoll: %s", strerror(errno));
+		return;
+	}
+
 	std::thread t(httpd);
 	t.detach();
 }
@@ -0,0 +1,84 @@
+// Copyright 2017 Archos SA
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef HTTPD_H
+#define HTTPD_H
+
+#include <stdint.h>
+#include <list>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+//What one HTTP client is currently reading
+struct StreamRange {
+	//Next byte to be sent
+	long long first;
+	//End of the requested range, -1 for end of file
+	long long second;
+	//How fast the client consumes data, in bytes/s, 0 when not measured yet
+	long long rate;
+	//Keep-alive connection between two requests: nobody reads there, until the next request moves it
+	bool idle;
+};
+
+//Listens on 127.0.0.1:port, port 0 picks one and prints it on stdout as before
+void start_httpd(int port = 0);
+
+//Files are identified by their torrent (hex info-hash) and their index in it,
+//and are served over HTTP as /<torrent>/<fileIndex>
+//Seek previews are listed by /preview/<torrent>/<fileIndex>[?n=<samples>]
+//and the OpenSubtitles hash is given by /subhash/<torrent>/<fileIndex>
+//No piece is available until setPieceAvailable() says so
+void setFileInfos(const std::string& torrent, int fileIndex, const char *filePath, long long fileSize, long long offset, int pieceLength);
+//Torrents requests may name, nFiles is -1 until metadata is there
+//Requests for other torrents, or for files past nFiles, get a 404
+void setTorrent(const std::string& torrent, int nFiles);
+//Files asked for over HTTP but not served yet, torrentd selects them
+//rangesChangedFd() is signaled when there are new ones
+std::vector<std::pair<std::string, int> > takeFileRequests();
+//Stop serving every file of torrent, and forget about it
+void removeFiles(const std::string& torrent);
+//Pieces are numbered torrent-wide
+void setPieceAvailable(const std::string& torrent, int piece, bool available);
+//Number of bytes that can be read from off in a served file, up to size
+long long availableData(const std::string& torrent, int fileIndex, long long off, long long size);
+//Answers /subhash requests for that file, the pending ones and those to come
+void setSubtitleHash(const std::string& torrent, int fileIndex, uint64_t hash);
+//Keyframes /preview samples, see findKeyframes(). Until then samples are spread evenly
+void setKeyframes(const std::string& torrent, int fileIndex, const std::vector<std::pair<long long, long long> >& keyframes);
+//Idle ones belong to keep-alive connections between two requests
+std::list<StreamRange> getRanges(const std::string& torrent, int fileIndex);
+//File ranges /preview clients are waiting for, [first, second[
+std::vector<std::pair<long long, long long> > getPreviews(const std::string& torrent, int fileIndex);
+//eventfd readable whenever a range opened, jumped or closed, or a file was requested, since it was last read
+int rangesChangedFd();
+
+//RAM budget for recently verified pieces, 0 disables the cache
+void setCacheSize(long long bytes);
+void cachePiece(const std::string& torrent, int piece, std::shared_ptr<const char> data, int size);
+void getCacheStats(long long& hits, long long& misses, long long& bytes);
+
+//One libtorrent session counter, as listed by session_stats_metrics()
+struct SessionCounter {
+	//libtorrent's dotted name, like net.recv_payload_bytes
+	std::string name;
+	long long value;
+	bool gauge;
+};
+//Latest session_stats_alert, exposed on /metrics along with httpd's own counters
+void setSessionStats(const std::vector<SessionCounter>& counters);
+
+#endif
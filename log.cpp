@@ -0,0 +1,165 @@
+// Copyright 2017 Archos SA
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include "log.h"
+
+//Longer messages are truncated
+static const int maxMessage = 512;
+//Must be a power of two
+static const unsigned ringSize = 1024;
+
+//Bounded queue after Dmitry Vyukov's: each slot's sequence tells whether it's free for
+//the producer at that position, or filled for the consumer
+struct LogSlot {
+	std::atomic<unsigned> sequence;
+	LogLevel level;
+	char message[maxMessage];
+};
+
+static LogSlot _ring[ringSize];
+static std::atomic<unsigned> _enqueuePos(0);
+//Only moved by the consumer, under _drain_l
+static unsigned _dequeuePos = 0;
+static std::atomic<unsigned> _dropped(0);
+static std::once_flag _ringInit;
+
+//Set by the writer thread before it sleeps, so that producers only make a syscall when needed
+static std::atomic<bool> _sleeping(false);
+static int _wakeFd = -1;
+//Serializes the writer thread and flushLogger()
+static std::mutex _drain_l;
+
+static void initRing() {
+	for(unsigned i = 0; i < ringSize; ++i)
+		_ring[i].sequence.store(i, std::memory_order_relaxed);
+}
+
+static const char *levelName(LogLevel level) {
+	switch(level) {
+		case LOG_DEBUG: return "D";
+		case LOG_INFO: return "I";
+		case LOG_WARN: return "W";
+		case LOG_ERROR: return "E";
+	}
+	return "?";
+}
+
+void logPrint(LogLevel level, const char *fmt, ...) {
+	std::call_once(_ringInit, initRing);
+
+	LogSlot *slot;
+	unsigned pos = _enqueuePos.load(std::memory_order_relaxed);
+	while(1) {
+		slot = &_ring[pos & (ringSize - 1)];
+		int diff = (int)(slot->sequence.load(std::memory_order_acquire) - pos);
+		if(diff == 0) {
+			if(_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				break;
+		} else if(diff < 0) {
+			//Full, the writer is behind
+			_dropped++;
+			return;
+		} else {
+			pos = _enqueuePos.load(std::memory_order_relaxed);
+		}
+	}
+
+	slot->level = level;
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(slot->message, sizeof(slot->message), fmt, ap);
+	va_end(ap);
+	slot->sequence.store(pos + 1, std::memory_order_seq_cst);
+
+	if(_sleeping.exchange(false)) {
+		uint64_t one = 1;
+		write(_wakeFd, &one, sizeof(one));
+	}
+}
+
+//Writes out everything queued, returns false if there was nothing
+static bool drain() {
+	std::unique_lock<std::mutex> lk(_drain_l);
+	std::call_once(_ringInit, initRing);
+
+	//Batch messages, one write() for many lines
+	char buffer[16*1024];
+	size_t used = 0;
+	bool any = false;
+	while(1) {
+		LogSlot& slot = _ring[_dequeuePos & (ringSize - 1)];
+		if((int)(slot.sequence.load(std::memory_order_seq_cst) - (_dequeuePos + 1)) < 0)
+			break;
+
+		if(used + maxMessage + 8 > sizeof(buffer)) {
+			write(2, buffer, used);
+			used = 0;
+		}
+		used += snprintf(buffer + used, sizeof(buffer) - used, "%s/%s\n", levelName(slot.level), slot.message);
+		slot.sequence.store(_dequeuePos + ringSize, std::memory_order_release);
+		_dequeuePos++;
+		any = true;
+	}
+
+	unsigned dropped = _dropped.exchange(0);
+	if(dropped)
+		used += snprintf(buffer + used, sizeof(buffer) - used, "W/%u log messages dropped\n", dropped);
+	if(used)
+		write(2, buffer, used);
+	return any;
+}
+
+static void logger() {
+	while(1) {
+		if(drain())
+			continue;
+
+		_sleeping = true;
+		//A message may have been queued before producers could see we're about to sleep
+		if(drain()) {
+			_sleeping = false;
+			continue;
+		}
+		struct pollfd pfd;
+		pfd.fd = _wakeFd;
+		pfd.events = POLLIN;
+		poll(&pfd, 1, 1000);
+		uint64_t count;
+		read(_wakeFd, &count, sizeof(count));
+		_sleeping = false;
+	}
+}
+
+void startLogger() {
+	_wakeFd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	if(_wakeFd == -1) {
+		perror("eventfd");
+		return;
+	}
+	std::thread t(logger);
+	t.detach();
+}
+
+void flushLogger() {
+	drain();
+}
@@ -0,0 +1,44 @@
+// Copyright 2017 Archos SA
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef LOG_H
+#define LOG_H
+
+//Leveled printf-style logging to stderr
+//Callers only format into a lock-free ring, a background thread does the writing,
+//so logging never blocks on the pipe to logcat. When the ring is full, messages are dropped and counted.
+
+enum LogLevel {
+	LOG_DEBUG,
+	LOG_INFO,
+	LOG_WARN,
+	LOG_ERROR,
+};
+
+void logPrint(LogLevel level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+//Starts the writer thread, messages logged before are kept until then
+void startLogger();
+//Writes everything logged so far, for use right before exiting
+void flushLogger();
+
+//Debug messages are compiled out of release builds, arguments aren't even evaluated
+#ifdef NDEBUG
+#define LOGD(...) do { } while(0)
+#else
+#define LOGD(...) logPrint(LOG_DEBUG, __VA_ARGS__)
+#endif
+#define LOGI(...) logPrint(LOG_INFO, __VA_ARGS__)
+#define LOGW(...) logPrint(LOG_WARN, __VA_ARGS__)
+#define LOGE(...) logPrint(LOG_ERROR, __VA_ARGS__)
+
+#endif
@@ -0,0 +1,73 @@
+// Copyright 2017 Archos SA
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdio.h>
+#include "metrics.h"
+
+Histogram::Histogram(const std::vector<long long>& bounds) :
+	_bounds(bounds), _counts(bounds.size() + 1, 0), _sum(0), _count(0) {
+}
+
+void Histogram::observe(long long value) {
+	size_t i = 0;
+	while(i < _bounds.size() && value > _bounds[i])
+		i++;
+	_counts[i]++;
+	_sum += value;
+	_count++;
+}
+
+void Histogram::render(std::string& out, const char *name, const char *help) const {
+	renderHeader(out, name, help, "histogram");
+
+	char line[256];
+	//Prometheus buckets are cumulative
+	long long cumulated = 0;
+	for(size_t i = 0; i < _bounds.size(); ++i) {
+		cumulated += _counts[i];
+		snprintf(line, sizeof(line), "%s_bucket{le=\"%lld\"} %lld\n", name, _bounds[i], cumulated);
+		out += line;
+	}
+	snprintf(line, sizeof(line), "%s_bucket{le=\"+Inf\"} %lld\n%s_sum %lld\n%s_count %lld\n",
+			name, _count, name, _sum, name, _count);
+	out += line;
+}
+
+const std::vector<long long>& latencyBucketsMs() {
+	static const std::vector<long long> buckets = { 5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 30000 };
+	return buckets;
+}
+
+void renderHeader(std::string& out, const char *name, const char *help, const char *type) {
+	out += "# HELP ";
+	out += name;
+	out += " ";
+	out += help;
+	out += "\n# TYPE ";
+	out += name;
+	out += " ";
+	out += type;
+	out += "\n";
+}
+
+void renderValue(std::string& out, const char *name, const char *labels, long long value) {
+	char line[256];
+	snprintf(line, sizeof(line), "%s%s %lld\n", name, labels, value);
+	out += line;
+}
+
+void renderMetric(std::string& out, const char *name, const char *help, const char *type, long long value) {
+	renderHeader(out, name, help, type);
+	renderValue(out, name, "", value);
+}
@@ -0,0 +1,46 @@
+// Copyright 2017 Archos SA
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <string>
+#include <vector>
+
+//Prometheus text exposition helpers, for the /metrics route
+
+//Distribution of values with fixed bucket bounds, observe() is a few compares and an increment
+class Histogram {
+	private:
+		std::vector<long long> _bounds;
+		//One per bound, plus +Inf
+		std::vector<long long> _counts;
+		long long _sum;
+		long long _count;
+	public:
+		//bounds must be increasing
+		Histogram(const std::vector<long long>& bounds);
+
+		void observe(long long value);
+		void render(std::string& out, const char *name, const char *help) const;
+};
+
+//Bucket bounds in ms, from a LAN round trip to a stuck swarm
+const std::vector<long long>& latencyBucketsMs();
+
+//type is "counter" or "gauge", labels is either empty or like {source="cache"}
+void renderHeader(std::string& out, const char *name, const char *help, const char *type);
+void renderValue(std::string& out, const char *name, const char *labels, long long value);
+void renderMetric(std::string& out, const char *name, const char *help, const char *type, long long value);
+
+#endif
@@ -0,0 +1,409 @@
+// Copyright 2017 Archos SA
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//Microbenchmarks of httpd's hot paths, each against what it replaced
+//- request parsing, on headers real players send
+//- file data to sockets, sendRange() in each mode against the 1 KiB read()/write() loop
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <new>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <boost/algorithm/string.hpp>
+#include "request.h"
+#include "sendrange.h"
+
+typedef std::chrono::steady_clock clock_type;
+
+//operator new calls so far, to show which code paths make none (strdup() isn't counted)
+static std::atomic<long long> _allocations(0);
+
+void* operator new(size_t size) {
+	_allocations++;
+	void *p = malloc(size ? size : 1);
+	if(!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void operator delete(void *p) noexcept {
+	free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+	free(p);
+}
+
+static double nsSince(clock_type::time_point start) {
+	return std::chrono::duration<double, std::nano>(clock_type::now() - start).count();
+}
+
+struct HeaderSet {
+	const char *name;
+	const char *request;
+};
+
+//As captured from each player seeking into a file
+static const HeaderSet headerSets[] = {
+	{ "ExoPlayer",
+		"GET /0123456789abcdef0123456789abcdef01234567/0 HTTP/1.1\r\n"
+		"User-Agent: ExoPlayerLib/2.19.1\r\n"
+		"Accept-Encoding: identity\r\n"
+		"Range: bytes=734003200-\r\n"
+		"Host: 127.0.0.1:8080\r\n"
+		"Connection: Keep-Alive\r\n"
+		"\r\n" },
+	{ "libVLC",
+		"GET /0123456789abcdef0123456789abcdef01234567/0 HTTP/1.1\r\n"
+		"Host: 127.0.0.1:8080\r\n"
+		"Accept: */*\r\n"
+		"Accept-Language: en_US\r\n"
+		"User-Agent: VLC/3.0.20 LibVLC/3.0.20\r\n"
+		"Range: bytes=734003200-\r\n"
+		"Icy-MetaData: 1\r\n"
+		"\r\n" },
+	{ "Kodi",
+		"GET /0123456789abcdef0123456789abcdef01234567/0 HTTP/1.1\r\n"
+		"Host: 127.0.0.1:8080\r\n"
+		"User-Agent: Kodi/21.0 (Linux; Android 12.0.0; Android TV Build/SP1A.210812.016) Android/12.0.0 Sys_CPU/aarch64 App_Bitness/64 Version/21.0-(21.0.0)-Git:20240406-1a8b9d6\r\n"
+		"Accept: */*\r\n"
+		"Accept-Charset: UTF-8,*;q=0.8\r\n"
+		"Range: bytes=734003200-\r\n"
+		"Connection: keep-alive\r\n"
+		"\r\n" },
+};
+
+//What httpd did before parseRequestHeaders(): a char at a time into std::string lines,
+//boost::split on the request line, and every header copied into a map
+class SocketHelper {
+	private:
+		const char *_buffer;
+		int _pos, _size;
+	public:
+		SocketHelper(const char *buffer, int size) : _buffer(buffer), _pos(0), _size(size) { };
+		void pop() {
+			if(_pos < _size)
+				_pos++;
+		}
+
+		int getc() {
+			int v = next();
+			pop();
+			return v;
+		}
+
+		int next() {
+			if(_pos >= _size)
+				return -1;
+			return (uint8_t)_buffer[_pos];
+		}
+
+		std::string getLine() {
+			std::string res="";
+			while(1) {
+				int v = getc();
+				if(v == -1)
+					return res;
+
+				if(v == '\r' && next() == '\n') {
+					pop();
+					return res;
+				}
+				res += (char)v;
+			}
+		}
+};
+
+static std::unordered_map<std::string, std::string> getRequest(SocketHelper& stream) {
+	std::unordered_map<std::string, std::string> res;
+	std::string line = stream.getLine();
+	std::vector<std::string> strs;
+	boost::split(strs, line, boost::is_any_of("\t "));
+	if(strs.size() < 3) {
+		res["error"] = "Invalid protocol";
+		return res;
+	}
+	res["method"] = strs[0];
+	res["file"] = strs[1];
+	res["version"] = strs[2];
+
+	while(true) {
+		std::string line = stream.getLine();
+		if(line=="")
+			return res;
+
+		char *key = strdup(line.c_str());
+		char *sep = strchr(key, ':');
+		if(!sep) {
+			res["error"] = "Failed to parse header";
+			free(key);
+			return res;
+		}
+		*sep = 0;
+		sep++;
+		if(*sep)
+			sep++;
+		res[key] = sep;
+		free(key);
+	}
+}
+
+static std::pair<long long,long long> parseRangeString(const std::string& str) {
+	auto res = std::make_pair(0LL, -1LL);
+	auto cstr = str.c_str();
+	if(strstr(cstr, "bytes=") != cstr)
+		return res;
+	cstr += strlen("bytes=");
+	char *next = NULL;
+	res.first = strtoll(cstr, &next, 0);
+	if(!next || *next != '-')
+		return res;
+	next++;
+	char *next2 = NULL;
+	res.second = strtoll(next, &next2, 0);
+	if(next == next2)
+		res.second = -1;
+	return res;
+}
+
+//Everything parseRequest() does before routing: find the end of headers, split them, read Range and Connection
+static long long parseInPlace(const char *buf, int size) {
+	const char *endOfHeaders = (const char*)memmem(buf, size, "\r\n\r\n", 4);
+	Request request;
+	if(!endOfHeaders || !parseRequestHeaders(buf, endOfHeaders + 4 - buf, request))
+		return -1;
+	std::pair<long long, long long> range;
+	parseRange(request.range, range);
+	bool keepAlive = request.version.equals("HTTP/1.1") ? !request.connection.iequals("close") : request.connection.iequals("keep-alive");
+	return range.first + keepAlive + request.path.size;
+}
+
+static long long parseCopying(const char *buf, int size) {
+	const char *endOfHeaders = (const char*)memmem(buf, size, "\r\n\r\n", 4);
+	if(!endOfHeaders)
+		return -1;
+	SocketHelper stream(buf, endOfHeaders + 4 - buf);
+	auto request = getRequest(stream);
+	if(request.count("error"))
+		return -1;
+	auto range = parseRangeString(request["Range"]);
+	const std::string& connection = request["Connection"];
+	bool keepAlive = request["version"] == "HTTP/1.1" ? !boost::iequals(connection, "close") : boost::iequals(connection, "keep-alive");
+	return range.first + keepAlive + request["file"].size();
+}
+
+static void benchParsing(const char *label, long long (*parse)(const char*, int)) {
+	const int iterations = 200000;
+	for(size_t i = 0; i < sizeof(headerSets) / sizeof(headerSets[0]); ++i) {
+		const HeaderSet& set = headerSets[i];
+		int size = strlen(set.request);
+		long long check = 0;
+		long long allocations = _allocations;
+		clock_type::time_point start = clock_type::now();
+		for(int j = 0; j < iterations; ++j)
+			check += parse(set.request, size);
+		double ns = nsSince(start) / iterations;
+		allocations = _allocations - allocations;
+		if(check != parse(set.request, size) * iterations) {
+			fprintf(stderr, "%s: inconsistent results on %s\n", label, set.name);
+			exit(1);
+		}
+		printf("parse %-9s %-10s %8.0f ns/request, %5.1f allocations/request\n",
+			set.name, label, ns, (double)allocations / iterations);
+	}
+}
+
+//Syscalls the data path makes: these replace libc's wrappers for the whole binary
+//The receiving side uses recv(), so only the sender is counted
+static std::atomic<long long> _syscalls(0);
+
+extern "C" ssize_t read(int fd, void *buf, size_t count) {
+	_syscalls++;
+	return syscall(SYS_read, fd, buf, count);
+}
+
+extern "C" ssize_t write(int fd, const void *buf, size_t count) {
+	_syscalls++;
+	return syscall(SYS_write, fd, buf, count);
+}
+
+extern "C" ssize_t pread64(int fd, void *buf, size_t count, off64_t offset) {
+	_syscalls++;
+	return syscall(SYS_pread64, fd, buf, count, offset);
+}
+
+extern "C" off_t lseek(int fd, off_t offset, int whence) throw() {
+	_syscalls++;
+	return syscall(SYS_lseek, fd, offset, whence);
+}
+
+extern "C" ssize_t sendfile64(int out, int in, off64_t *offset, size_t count) throw() {
+	_syscalls++;
+	return syscall(SYS_sendfile, out, in, offset, count);
+}
+
+extern "C" ssize_t splice(int in, loff_t *inOffset, int out, loff_t *outOffset, size_t len, unsigned int flags) {
+	_syscalls++;
+	return syscall(SYS_splice, in, inOffset, out, outOffset, len, flags);
+}
+
+static const long long benchFileSize = 256LL * 1024 * 1024;
+static const long long benchBytes = 1024LL * 1024 * 1024;
+//What httpd hands to sendRange() at once
+static const long long sendChunk = 1024 * 1024;
+
+static double cpuMs(const struct rusage& ru) {
+	return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000. + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1000.;
+}
+
+//Connected TCP pair over loopback, like a player talking to httpd
+static bool socketPair(int& sender, int& receiver) {
+	int listener = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t len = sizeof(addr);
+	if(listener == -1 || bind(listener, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(listener, 1) == -1 ||
+			getsockname(listener, (struct sockaddr*)&addr, &len) == -1) {
+		perror("listen");
+		return false;
+	}
+	receiver = socket(AF_INET, SOCK_STREAM, 0);
+	if(connect(receiver, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+		perror("connect");
+		return false;
+	}
+	sender = accept(listener, NULL, NULL);
+	close(listener);
+	return sender != -1;
+}
+
+//Sends benchBytes of fileFd through send, a player thread reading on the other end
+//send returns bytes sent from offset, at most len, or -1
+static void benchSend(const char *label, int fileFd, std::function<long long (int sock, long long offset, long long len)> send) {
+	int sender, receiver;
+	if(!socketPair(sender, receiver))
+		exit(1);
+	std::thread player([receiver]() {
+			std::vector<char> buf(1024 * 1024);
+			while(recv(receiver, buf.data(), buf.size(), 0) > 0)
+				;
+		});
+
+	long long syscalls = _syscalls;
+	struct rusage before, after;
+	getrusage(RUSAGE_THREAD, &before);
+	clock_type::time_point start = clock_type::now();
+	long long sent = 0;
+	while(sent < benchBytes) {
+		long long offset = sent % benchFileSize;
+		long long res = send(sender, offset, std::min(benchFileSize - offset, benchBytes - sent));
+		if(res <= 0) {
+			fprintf(stderr, "%s: %s\n", label, strerror(errno));
+			exit(1);
+		}
+		sent += res;
+	}
+	double seconds = nsSince(start) / 1e9;
+	getrusage(RUSAGE_THREAD, &after);
+	syscalls = _syscalls - syscalls;
+
+	close(sender);
+	player.join();
+	close(receiver);
+	double gib = (double)sent / (1024 * 1024 * 1024);
+	printf("send %-18s %9.0f syscalls/GiB, %6.0f ms CPU/GiB, %7.1f MiB/s\n",
+		label, syscalls / gib, (cpuMs(after) - cpuMs(before)) / gib, sent / 1024. / 1024. / seconds);
+}
+
+static void benchSending() {
+	char path[] = "/tmp/microbench.XXXXXX";
+	int fd = mkstemp(path);
+	if(fd == -1) {
+		perror("mkstemp");
+		exit(1);
+	}
+	unlink(path);
+	std::vector<char> buf(1024 * 1024, 'x');
+	for(long long done = 0; done < benchFileSize; done += buf.size()) {
+		if(::write(fd, buf.data(), buf.size()) != (ssize_t)buf.size()) {
+			perror("write");
+			exit(1);
+		}
+	}
+
+	const SendMode modes[] = { SEND_SENDFILE, SEND_SPLICE, SEND_COPY };
+	const char *labels[] = { "sendRange sendfile", "sendRange splice", "sendRange copy" };
+	for(int i = 0; i < 3; ++i) {
+		SendMode mode = modes[i];
+		int pipeFds[2] = { -1, -1 };
+		long long pipeBytes = 0;
+		benchSend(labels[i], fd, [&](int sock, long long offset, long long len) {
+				return sendRange(sock, fd, offset, std::min(len, sendChunk), mode, pipeFds, pipeBytes);
+			});
+		if(mode != modes[i])
+			printf("(%s fell back to mode %d)\n", labels[i], mode);
+		if(pipeFds[0] != -1) {
+			close(pipeFds[0]);
+			close(pipeFds[1]);
+		}
+	}
+
+	//What serveFile() did before sendRange(): seek, ask how much is there, then 1 KiB through a stack buffer
+	std::function<int (long long, int)> availableData = [](long long off, int size) {
+		return (int)std::min((long long)size, benchFileSize - off);
+	};
+	benchSend("1 KiB loop", fd, [&](int sock, long long offset, long long len) {
+			long long sent = 0;
+			while(sent < len) {
+				lseek(fd, offset + sent, SEEK_SET);
+				char buffer[1024];
+				int length = availableData(offset + sent, sizeof(buffer));
+				if(!length)
+					break;
+				int res = read(fd, buffer, length);
+				if(res <= 0)
+					return sent ? sent : -1LL;
+				int res2 = write(sock, buffer, res);
+				if(res2 <= 0)
+					return sent ? sent : -1LL;
+				sent += res2;
+			}
+			return sent;
+		});
+	close(fd);
+}
+
+int main() {
+	benchParsing("in place", parseInPlace);
+	benchParsing("copying", parseCopying);
+	benchSending();
+	return 0;
+}
@@ -0,0 +1,116 @@
+// Copyright 2017 Archos SA
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <limits.h>
+
+#include "piececache.h"
+
+PieceCache::PieceCache(long long maxBytes) :
+	_maxBytes(maxBytes), _bytes(0), _tick(0), _hits(0), _misses(0) {
+}
+
+void PieceCache::setMaxBytes(long long maxBytes) {
+	std::unique_lock<std::mutex> lk(_lock);
+	_maxBytes = maxBytes;
+	evict(std::vector<long long>(), 0);
+}
+
+//Distance from piece to the closest reader before it, INT_MAX when it's behind all of them
+static long long distanceAhead(long long piece, const std::vector<long long>& playheads) {
+	long long res = LLONG_MAX;
+	for(auto it = playheads.begin(); it != playheads.end(); ++it) {
+		if(piece >= *it && piece - *it < res)
+			res = piece - *it;
+	}
+	return res;
+}
+
+void PieceCache::evict(const std::vector<long long>& playheads, long long needed) {
+	while(!_entries.empty() && _bytes + needed > _maxBytes) {
+		auto victim = _entries.begin();
+		long long victimDistance = -1;
+		for(auto it = _entries.begin(); it != _entries.end(); ++it) {
+			long long distance = distanceAhead(it->first, playheads);
+			if(distance > victimDistance ||
+					(distance == victimDistance && it->second.lastUse < victim->second.lastUse)) {
+				victim = it;
+				victimDistance = distance;
+			}
+		}
+		_bytes -= victim->second.size;
+		_entries.erase(victim);
+	}
+}
+
+void PieceCache::insert(long long piece, std::shared_ptr<const char> data, int size, const std::vector<long long>& playheads) {
+	std::unique_lock<std::mutex> lk(_lock);
+	if(size > _maxBytes || _entries.count(piece))
+		return;
+
+	evict(playheads, size);
+
+	Entry e;
+	e.data = data;
+	e.size = size;
+	e.lastUse = ++_tick;
+	_entries[piece] = e;
+	_bytes += size;
+}
+
+std::shared_ptr<const char> PieceCache::lookup(long long piece, int& size) {
+	std::unique_lock<std::mutex> lk(_lock);
+	auto it = _entries.find(piece);
+	if(it == _entries.end()) {
+		_misses++;
+		return NULL;
+	}
+	_hits++;
+	it->second.lastUse = ++_tick;
+	size = it->second.size;
+	return it->second.data;
+}
+
+void PieceCache::remove(long long piece) {
+	std::unique_lock<std::mutex> lk(_lock);
+	auto it = _entries.find(piece);
+	if(it == _entries.end())
+		return;
+	_bytes -= it->second.size;
+	_entries.erase(it);
+}
+
+void PieceCache::removeBetween(long long first, long long last) {
+	std::unique_lock<std::mutex> lk(_lock);
+	for(auto it = _entries.begin(); it != _entries.end();) {
+		if(it->first >= first && it->first <= last) {
+			_bytes -= it->second.size;
+			it = _entries.erase(it);
+		} else {
+			++it;
+		}
+	}
+}
+
+void PieceCache::clear() {
+	std::unique_lock<std::mutex> lk(_lock);
+	_entries.clear();
+	_bytes = 0;
+}
+
+void PieceCache::stats(long long& hits, long long& misses, long long& bytes) {
+	std::unique_lock<std::mutex> lk(_lock);
+	hits = _hits;
+	misses = _misses;
+	bytes = _bytes;
+}
@@ -0,0 +1,57 @@
+// Copyright 2017 Archos SA
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef PIECECACHE_H
+#define PIECECACHE_H
+
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+//Recently verified pieces kept in RAM, so that the HTTP side doesn't read back what was just written
+class PieceCache {
+	private:
+		struct Entry {
+			std::shared_ptr<const char> data;
+			int size;
+			unsigned long long lastUse;
+		};
+		std::mutex _lock;
+		std::unordered_map<long long, Entry> _entries;
+		long long _maxBytes;
+		long long _bytes;
+		unsigned long long _tick;
+		long long _hits, _misses;
+
+		void evict(const std::vector<long long>& playheads, long long needed);
+	public:
+		PieceCache(long long maxBytes);
+		void setMaxBytes(long long maxBytes);
+
+		//Pieces are identified by a key, growing with their position in the torrent
+		//playheads are the keys of the pieces readers are currently at
+		//What's behind every reader goes first, then what's farthest ahead, then least recently used
+		void insert(long long piece, std::shared_ptr<const char> data, int size, const std::vector<long long>& playheads);
+		//Returns NULL when piece isn't cached
+		std::shared_ptr<const char> lookup(long long piece, int& size);
+		void remove(long long piece);
+		//Remove all keys in [first, last]
+		void removeBetween(long long first, long long last);
+		void clear();
+
+		void stats(long long& hits, long long& misses, long long& bytes);
+};
+
+#endif
@@ -0,0 +1,138 @@
+// Copyright 2017 Archos SA
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <string.h>
+#include <strings.h>
+
+#include "log.h"
+#include "request.h"
+
+static const char *skipBlanks(const char *p, const char *end) {
+	while(p != end && (*p == ' ' || *p == '\t'))
+		p++;
+	return p;
+}
+
+static Token nextWord(const char *&p, const char *end) {
+	p = skipBlanks(p, end);
+	Token t = { p, 0 };
+	while(p != end && *p != ' ' && *p != '\t')
+		p++;
+	t.size = p - t.data;
+	return t;
+}
+
+bool parseRequestHeaders(const char *buf, int size, Request& req) {
+	memset(&req, 0, sizeof(req));
+	const char *end = buf + size;
+
+	bool first = true;
+	for(const char *line = buf; line < end;) {
+		const char *eol = (const char*)memchr(line, '\n', end - line);
+		if(!eol)
+			return false;
+		const char *next = eol + 1;
+		if(eol != line && eol[-1] == '\r')
+			eol--;
+		if(eol == line)
+			break;
+
+		if(first) {
+			const char *p = line;
+			req.method = nextWord(p, eol);
+			req.path = nextWord(p, eol);
+			req.version = nextWord(p, eol);
+			if(!req.method.size || !req.path.size || !req.version.size)
+				return false;
+			first = false;
+		} else {
+			const char *colon = (const char*)memchr(line, ':', eol - line);
+			if(!colon) {
+				LOGW("Failed to parse %.*s", (int)(eol - line), line);
+				return false;
+			}
+			Token name = { line, (int)(colon - line) };
+			const char *value = skipBlanks(colon + 1, eol);
+			const char *valueEnd = eol;
+			while(valueEnd != value && (valueEnd[-1] == ' ' || valueEnd[-1] == '\t'))
+				valueEnd--;
+			Token t = { value, (int)(valueEnd - value) };
+			if(name.iequals("Range"))
+				req.range = t;
+			else if(name.iequals("Connection"))
+				req.connection = t;
+		}
+		line = next;
+	}
+	return !first;
+}
+
+bool parseNumber(const char *&p, const char *end, long long& value) {
+	const char *start = p;
+	value = 0;
+	while(p != end && *p >= '0' && *p <= '9' && value < (1LL << 56))
+		value = value * 10 + (*p++ - '0');
+	return p != start;
+}
+
+bool parseRange(const Token& range, std::pair<long long,long long>& res) {
+	res = std::make_pair(0LL, -1LL);
+	const char *p = range.data;
+	const char *end = p + range.size;
+
+	static const char prefix[] = "bytes=";
+	if(range.size < (int)strlen(prefix) || strncasecmp(p, prefix, strlen(prefix)))
+		return true;
+	p += strlen(prefix);
+
+	if(p != end && *p == '-') {
+		p++;
+		long long suffix;
+		if(!parseNumber(p, end, suffix))
+			return true;
+		res.first = -suffix;
+		return suffix > 0;
+	}
+
+	long long first;
+	if(!parseNumber(p, end, first) || p == end || *p != '-')
+		return true;
+	p++;
+	long long last;
+	bool hasLast = parseNumber(p, end, last);
+	if(hasLast && last < first)
+		return false;
+	res.first = first;
+	if(hasLast)
+		res.second = last;
+
+	return true;
+}
+
+bool queryParam(const Token& query, const char *name, Token& value) {
+	const char *p = query.data;
+	const char *end = p + query.size;
+	int nameSize = strlen(name);
+	while(p && p < end) {
+		const char *next = (const char*)memchr(p, '&', end - p);
+		const char *paramEnd = next ? next : end;
+		if(paramEnd - p > nameSize && !memcmp(p, name, nameSize) && p[nameSize] == '=') {
+			value.data = p + nameSize + 1;
+			value.size = paramEnd - value.data;
+			return true;
+		}
+		p = next ? next + 1 : NULL;
+	}
+	return false;
+}
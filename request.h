@@ -0,0 +1,58 @@
+// Copyright 2017 Archos SA
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef REQUEST_H
+#define REQUEST_H
+
+#include <string.h>
+#include <strings.h>
+#include <utility>
+
+//Part of a request, pointing into the connection's buffer
+struct Token {
+	const char *data;
+	int size;
+
+	bool equals(const char *str) const {
+		return (int)strlen(str) == size && !memcmp(data, str, size);
+	}
+	bool iequals(const char *str) const {
+		return (int)strlen(str) == size && !strncasecmp(data, str, size);
+	}
+};
+
+//The only parts of a request we care about, empty tokens for missing ones
+struct Request {
+	Token method;
+	Token path;
+	Token version;
+	Token range;
+	Token connection;
+};
+
+//Parses size bytes of headers, ending with their empty line, without copying anything
+bool parseRequestHeaders(const char *buf, int size, Request& req);
+
+//Reads decimal digits, returns false if there were none
+bool parseNumber(const char *&p, const char *end, long long& value);
+
+//bytes=first-[last], bytes=-suffix gives a negative first
+//last is inclusive, -1 when missing, malformed ranges are ignored and give the whole file
+//Returns false when no byte can satisfy it: last before first, or an empty suffix
+bool parseRange(const Token& range, std::pair<long long,long long>& res);
+
+//Value of name in a query string (what follows '?'), false if it's not there
+bool queryParam(const Token& query, const char *name, Token& value);
+
+#endif
@@ -0,0 +1,67 @@
+// Copyright 2017 Archos SA
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include "log.h"
+#include "sendrange.h"
+
+long long sendRange(int sock, int fileFd, long long offset, long long len, SendMode& mode, int pipeFds[2], long long& pipeBytes) {
+	if(mode == SEND_SENDFILE) {
+		off64_t off = offset;
+		ssize_t res = sendfile64(sock, fileFd, &off, len);
+		if(res >= 0 || (errno != EINVAL && errno != ENOSYS))
+			return res;
+		LOGW("sendfile() not supported, falling back to splice()");
+		mode = SEND_SPLICE;
+	}
+
+	if(mode == SEND_SPLICE) {
+		if(pipeFds[0] == -1 && pipe2(pipeFds, O_NONBLOCK|O_CLOEXEC) == -1) {
+			LOGE("pipe: %s", strerror(errno));
+			mode = SEND_COPY;
+		} else {
+			if(!pipeBytes) {
+				loff_t off = offset;
+				ssize_t in_pipe = splice(fileFd, &off, pipeFds[1], NULL, len, SPLICE_F_MOVE|SPLICE_F_MORE|SPLICE_F_NONBLOCK);
+				if(in_pipe < 0 && (errno == EINVAL || errno == ENOSYS)) {
+					LOGW("splice() not supported, falling back to read()/write()");
+					mode = SEND_COPY;
+				} else if(in_pipe <= 0) {
+					return in_pipe;
+				} else {
+					pipeBytes = in_pipe;
+				}
+			}
+			if(pipeBytes) {
+				ssize_t res = splice(pipeFds[0], NULL, sock, NULL, pipeBytes, SPLICE_F_MOVE|SPLICE_F_MORE|SPLICE_F_NONBLOCK);
+				if(res > 0)
+					pipeBytes -= res;
+				return res;
+			}
+		}
+	}
+
+	char buffer[64*1024];
+	if(len > (long long)sizeof(buffer))
+		len = sizeof(buffer);
+	ssize_t res = pread64(fileFd, buffer, len, offset);
+	if(res <= 0)
+		return res;
+	//What the socket doesn't take now will be read again next time
+	return write(sock, buffer, res);
+}
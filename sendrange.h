@@ -0,0 +1,30 @@
+// Copyright 2017 Archos SA
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SENDRANGE_H
+#define SENDRANGE_H
+
+//How file data gets to sockets, each mode falls back to the next one when the kernel lacks it
+enum SendMode {
+	SEND_SENDFILE,
+	SEND_SPLICE,
+	SEND_COPY,
+};
+
+//Copies up to len bytes at offset of fileFd to sock, without going through userland when possible
+//pipeFds is the connection's pipe for splice(), created on first use, pipeBytes what it still holds
+//Returns number of bytes that reached the socket, or -1 with errno set
+long long sendRange(int sock, int fileFd, long long offset, long long len, SendMode& mode, int pipeFds[2], long long& pipeBytes);
+
+#endif
@@ -0,0 +1,368 @@
+// Copyright 2017 Archos SA
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//Offline streaming benchmark: seeds a synthetic torrent from local libtorrent sessions,
+//runs torrentd against them in local test mode (-l), and plays scripted player requests on its HTTP port
+//Reports launch to first byte, seek to data p50/p99 and sustained throughput
+
+#include <errno.h>
+#include <ftw.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "libtorrent/bencode.hpp"
+#include "libtorrent/create_torrent.hpp"
+#include "libtorrent/session.hpp"
+#include "libtorrent/torrent_flags.hpp"
+#include "libtorrent/torrent_info.hpp"
+
+using namespace libtorrent;
+typedef std::chrono::steady_clock clock_type;
+
+static long long _fileSize = 2048LL * 1024 * 1024;
+static int _nSeeders = 2;
+static int _nSeeks = 50;
+static long long _sequentialBytes = 512LL * 1024 * 1024;
+//What a player reads after a seek before it starts decoding
+static const long long seekReadBytes = 256 * 1024;
+static const int pieceSize = 1024 * 1024;
+static const int seederBasePort = 16881;
+static const int httpPort = 16880;
+//Longest we wait for any byte, a stuck run must end
+static const int timeoutSeconds = 120;
+
+static double msSince(clock_type::time_point start) {
+	return std::chrono::duration<double, std::milli>(clock_type::now() - start).count();
+}
+
+//Pseudo-random content, so that nothing on the way can compress or dedupe it
+static bool writeSyntheticFile(const std::string& path, long long size) {
+	struct stat st;
+	if(stat(path.c_str(), &st) == 0 && st.st_size == size)
+		return true;
+	int fd = open(path.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if(fd == -1)
+		return false;
+	std::vector<uint64_t> buf(1024 * 1024 / sizeof(uint64_t));
+	uint64_t x = 88172645463325252ULL;
+	for(long long done = 0; done < size;) {
+		for(size_t i = 0; i < buf.size(); ++i) {
+			x ^= x << 13;
+			x ^= x >> 7;
+			x ^= x << 17;
+			buf[i] = x;
+		}
+		long long len = std::min(size - done, (long long)(buf.size() * sizeof(uint64_t)));
+		if(write(fd, buf.data(), len) != len) {
+			close(fd);
+			return false;
+		}
+		done += len;
+	}
+	close(fd);
+	return true;
+}
+
+static bool writeTorrent(const std::string& dataDir, const std::string& torrentPath) {
+	file_storage fs;
+	add_files(fs, dataDir + "/bench.bin");
+	create_torrent ct(fs, pieceSize, create_torrent::v1_only);
+	error_code ec;
+	set_piece_hashes(ct, dataDir, ec);
+	if(ec) {
+		std::cerr << "Hashing failed: " << ec.message() << std::endl;
+		return false;
+	}
+	std::vector<char> out;
+	bencode(std::back_inserter(out), ct.generate());
+	std::ofstream f(torrentPath, std::ios::binary);
+	f.write(out.data(), out.size());
+	return f.good();
+}
+
+static session* startSeeder(std::shared_ptr<torrent_info> ti, const std::string& dataDir, int port) {
+	settings_pack pack;
+	pack.set_str(settings_pack::listen_interfaces, "127.0.0.1:" + std::to_string(port));
+	pack.set_bool(settings_pack::enable_natpmp, false);
+	pack.set_bool(settings_pack::enable_upnp, false);
+	pack.set_bool(settings_pack::enable_lsd, false);
+	pack.set_bool(settings_pack::enable_dht, false);
+	pack.set_bool(settings_pack::allow_multiple_connections_per_ip, true);
+	session *ses = new session(pack);
+
+	add_torrent_params p;
+	p.ti = ti;
+	p.save_path = dataDir;
+	//We wrote the data, no need to check it
+	p.flags |= torrent_flags::seed_mode;
+	ses->add_torrent(p);
+	return ses;
+}
+
+static pid_t startTorrentd(const std::string& torrentd, const std::string& leechDir, const std::string& torrentPath, int& controlFd) {
+	int control[2];
+	if(pipe(control) == -1)
+		return -1;
+	pid_t pid = fork();
+	if(pid != 0) {
+		close(control[0]);
+		controlFd = control[1];
+		return pid;
+	}
+
+	if(chdir(leechDir.c_str()) == -1)
+		_exit(1);
+	dup2(control[0], 0);
+	close(control[1]);
+	int log = open("torrentd.log", O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if(log != -1) {
+		dup2(log, 1);
+		dup2(log, 2);
+	}
+
+	std::vector<std::string> args = { torrentd, "-l", "-H", std::to_string(httpPort) };
+	for(int i = 0; i < _nSeeders; ++i) {
+		args.push_back("-p");
+		args.push_back("127.0.0.1:" + std::to_string(seederBasePort + i));
+	}
+	args.push_back(torrentPath);
+	args.push_back("/dev/null");
+	std::vector<char*> argv;
+	for(auto it = args.begin(); it != args.end(); ++it)
+		argv.push_back((char*)it->c_str());
+	argv.push_back(NULL);
+	execv(argv[0], argv.data());
+	_exit(127);
+}
+
+//Reads len bytes of path from off, like a player after a seek
+//Returns the bytes read, ttfbMs is when the first body byte came, -1 when none did
+//status is the HTTP status, 0 when the connection failed
+static long long readRange(const std::string& path, long long off, long long len, double& ttfbMs, int& status) {
+	ttfbMs = -1;
+	status = 0;
+	clock_type::time_point start = clock_type::now();
+	int fd = socket(AF_INET, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if(fd == -1)
+		return 0;
+	struct timeval tv = { timeoutSeconds, 0 };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(httpPort);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if(connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+		close(fd);
+		return 0;
+	}
+
+	std::string request = "GET " + path + " HTTP/1.1\r\nHost: 127.0.0.1\r\nConnection: close\r\n" +
+		"Range: bytes=" + std::to_string(off) + "-" + std::to_string(off + len - 1) + "\r\n\r\n";
+	if(write(fd, request.data(), request.size()) != (ssize_t)request.size()) {
+		close(fd);
+		return 0;
+	}
+
+	std::string headers;
+	std::vector<char> buf(256 * 1024);
+	long long body = 0;
+	while(body < len) {
+		ssize_t n = read(fd, buf.data(), buf.size());
+		if(n <= 0)
+			break;
+		if(status == 0) {
+			headers.append(buf.data(), n);
+			size_t end = headers.find("\r\n\r\n");
+			if(end == std::string::npos)
+				continue;
+			status = atoi(headers.c_str() + headers.find(' ') + 1);
+			n = headers.size() - end - 4;
+			if(status != 206 && status != 200)
+				break;
+		}
+		if(n > 0 && ttfbMs < 0)
+			ttfbMs = msSince(start);
+		body += n;
+	}
+	close(fd);
+	return body;
+}
+
+static double percentile(std::vector<double> values, int p) {
+	if(values.empty())
+		return 0;
+	std::sort(values.begin(), values.end());
+	return values[std::min(values.size() - 1, values.size() * p / 100)];
+}
+
+static int removeEntry(const char *path, const struct stat *, int, struct FTW *) {
+	return remove(path);
+}
+
+int main(int argc, char *argv[]) {
+	std::string workDir = "streambench.d";
+	int opt;
+	while((opt = getopt(argc, argv, "s:n:k:t:d:")) != -1) {
+		switch(opt) {
+			case 's':
+				_fileSize = atoll(optarg) * 1024 * 1024;
+				break;
+			case 'n':
+				_nSeeders = atoi(optarg);
+				break;
+			case 'k':
+				_nSeeks = atoi(optarg);
+				break;
+			case 't':
+				_sequentialBytes = atoll(optarg) * 1024 * 1024;
+				break;
+			case 'd':
+				workDir = optarg;
+				break;
+			default:
+				argc = 0;
+				break;
+		}
+	}
+	if(argc - optind < 1 || _fileSize <= 0 || _nSeeders <= 0) {
+		std::cerr << argv[0] << ": [-s <file MB>] [-n <seeders>] [-k <seeks>] [-t <sequential MB>] [-d <work dir>] <torrentd>" << std::endl;
+		return 1;
+	}
+	char torrentd[PATH_MAX];
+	if(!realpath(argv[optind], torrentd)) {
+		std::cerr << argv[optind] << ": " << strerror(errno) << std::endl;
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	//The synthetic file and its torrent are kept between runs, hashing GBs takes a while
+	mkdir(workDir.c_str(), 0755);
+	char dir[PATH_MAX];
+	if(!realpath(workDir.c_str(), dir)) {
+		std::cerr << workDir << ": " << strerror(errno) << std::endl;
+		return 1;
+	}
+	std::string dataDir = std::string(dir) + "/seed";
+	std::string torrentPath = dataDir + "-" + std::to_string(_fileSize) + ".torrent";
+	std::string leechDir = std::string(dir) + "/leech";
+	mkdir(dataDir.c_str(), 0755);
+	struct stat st;
+	bool regenerate = stat((dataDir + "/bench.bin").c_str(), &st) != 0 || st.st_size != _fileSize;
+	if(!writeSyntheticFile(dataDir + "/bench.bin", _fileSize)) {
+		std::cerr << "Can't write " << dataDir << "/bench.bin: " << strerror(errno) << std::endl;
+		return 1;
+	}
+	if((regenerate || stat(torrentPath.c_str(), &st) != 0) && !writeTorrent(dataDir, torrentPath))
+		return 1;
+
+	error_code ec;
+	auto ti = std::make_shared<torrent_info>(torrentPath, ec);
+	if(ec) {
+		std::cerr << torrentPath << ": " << ec.message() << std::endl;
+		return 1;
+	}
+	std::stringstream ss;
+	ss << "/" << ti->info_hashes().get_best() << "/0";
+	std::string path = ss.str();
+
+	std::vector<session*> seeders;
+	for(int i = 0; i < _nSeeders; ++i)
+		seeders.push_back(startSeeder(ti, dataDir, seederBasePort + i));
+
+	//Every run starts with nothing downloaded
+	nftw(leechDir.c_str(), removeEntry, 16, FTW_DEPTH|FTW_PHYS);
+	mkdir(leechDir.c_str(), 0755);
+	int controlFd = -1;
+	clock_type::time_point launch = clock_type::now();
+	pid_t pid = startTorrentd(torrentd, leechDir, torrentPath, controlFd);
+	if(pid == -1) {
+		std::cerr << "Can't start torrentd: " << strerror(errno) << std::endl;
+		return 1;
+	}
+
+	//Launch to first byte: retried until the HTTP port is up and knows the torrent
+	double ttfb = -1;
+	while(msSince(launch) < timeoutSeconds * 1000.) {
+		double ms;
+		int status;
+		if(readRange(path, 0, seekReadBytes, ms, status) > 0) {
+			ttfb = msSince(launch);
+			break;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	}
+	if(ttfb < 0) {
+		std::cerr << "No data from torrentd, see " << leechDir << "/torrentd.log" << std::endl;
+		kill(pid, SIGTERM);
+		waitpid(pid, NULL, 0);
+		return 1;
+	}
+
+	//Player probing the end of the file for the mp4 moov or mkv Cues, then playing from the start
+	std::vector<double> seeks;
+	double ms;
+	int status;
+	long long tail = std::min(seekReadBytes, _fileSize);
+	if(readRange(path, _fileSize - tail, tail, ms, status) > 0)
+		seeks.push_back(ms);
+
+	long long sequential = std::min(_sequentialBytes, _fileSize);
+	clock_type::time_point start = clock_type::now();
+	long long played = readRange(path, 0, sequential, ms, status);
+	double throughput = played / 1024. / 1024. / (msSince(start) / 1000.);
+
+	//Seeks into what wasn't played yet, same offsets each run
+	srand(1);
+	int failed = 0;
+	for(int i = 0; i < _nSeeks && sequential + seekReadBytes < _fileSize; ++i) {
+		long long off = sequential + (long long)((double)rand() / RAND_MAX * (_fileSize - sequential - seekReadBytes));
+		if(readRange(path, off, seekReadBytes, ms, status) == seekReadBytes)
+			seeks.push_back(ms);
+		else
+			failed++;
+	}
+
+	close(controlFd);
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+	for(auto it = seeders.begin(); it != seeders.end(); ++it)
+		delete *it;
+
+	printf("file: %lld MiB, %d seeders\n", _fileSize / 1024 / 1024, _nSeeders);
+	printf("launch to first byte: %.1f ms\n", ttfb);
+	printf("seek to data: p50 %.1f ms, p99 %.1f ms (%zu seeks, %d failed)\n",
+		percentile(seeks, 50), percentile(seeks, 99), seeks.size(), failed);
+	printf("sustained throughput: %.1f MiB/s over %lld MiB\n", throughput, played / 1024 / 1024);
+	return failed ? 1 : 0;
+}
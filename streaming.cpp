@@ -0,0 +1,164 @@
+// Copyright 2017 Archos SA
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <limits.h>
+#include <algorithm>
+#include "log.h"
+#include "streaming.h"
+
+using namespace libtorrent;
+
+long long bufferWindow(long long rate, long long downloadRate) {
+	long long window = rate * bufferSeconds;
+	//The swarm is slower than playback: look further ahead, so more pieces are fetched in parallel
+	if(downloadRate > 0 && downloadRate < rate)
+		window *= std::min(rate / downloadRate + 1, 4LL);
+	return std::max(minBufferWindow, std::min(window, maxBufferWindow));
+}
+
+long long storageBudgetPieces(long long storageBudget, int pieceLength, long long nRanges) {
+	if(!storageBudget)
+		return LLONG_MAX;
+	return std::max(1LL, storageBudget / pieceLength / std::max(1LL, nRanges));
+}
+
+long long rangeEnd(const StreamInfos& infos, const StreamRange& range) {
+	if(range.second == -1)
+		return infos.fileSize;
+	return std::min(range.second + 1, infos.fileSize);
+}
+
+int rangeLastPiece(const StreamInfos& infos, const StreamRange& range) {
+	long long end = std::max(rangeEnd(infos, range), range.first + 1);
+	return std::min<long long>(infos.lastPiece, (end - 1 + infos.offset) / infos.pieceLength);
+}
+
+void computePriorities(const std::vector<FileDemand>& files, const typed_bitfield<piece_index_t>& have,
+		long long downloadRate, long long storageBudget,
+		std::vector<download_priority_t>& priorities, std::map<int, int>& deadlines) {
+	priorities.assign(have.size(), dont_download);
+	deadlines.clear();
+
+	long long nRanges = 0;
+	for(auto f = files.begin(); f != files.end(); ++f)
+		for(auto it = f->ranges->begin(); it != f->ranges->end(); ++it)
+			nRanges += !it->idle;
+
+	for(auto f = files.begin(); f != files.end(); ++f) {
+		const StreamInfos& infos = *f->infos;
+		//Idle keep-alive connections read nothing until their next request
+		std::list<StreamRange> fileRanges;
+		for(auto it = f->ranges->begin(); it != f->ranges->end(); ++it)
+			if(!it->idle)
+				fileRanges.push_back(*it);
+
+		//Set all pieces in the file to default priority
+		//With a storage budget, only what fits ahead of readers, anything further would be evicted before being read
+		std::vector<std::pair<int, int> > wanted;
+		long long budgetPieces = storageBudgetPieces(storageBudget, infos.pieceLength, nRanges);
+		if(storageBudget) {
+			if(fileRanges.empty())
+				wanted.push_back(std::make_pair(infos.firstPiece, (int)std::min<long long>(infos.lastPiece, infos.firstPiece + budgetPieces - 1)));
+			for(auto it = fileRanges.begin(); it != fileRanges.end(); ++it) {
+				int pieceN = (it->first + infos.offset)/infos.pieceLength;
+				wanted.push_back(std::make_pair(pieceN, (int)std::min<long long>(rangeLastPiece(infos, *it), pieceN + budgetPieces - 1)));
+			}
+		} else {
+			wanted.push_back(std::make_pair(infos.firstPiece, infos.lastPiece));
+		}
+		for(auto w = wanted.begin(); w != wanted.end(); ++w) {
+			for(int j = w->first;
+					j<= w->second && j <infos.nTotalPieces;
+					++j)
+				if(priorities[j] == dont_download)
+					priorities[j] = low_priority;
+		}
+		//We will most likely need the end of the file
+		//Either because of mkv/mp4, or to fingerprint subtitles
+		if(infos.lastPiece >= infos.nTotalPieces) {
+			LOGE("lastPiece >= TotalPieces");
+		} else {
+			priorities[infos.lastPiece] = top_priority;
+		}
+
+		//Container index is needed before the first frame, whatever the reader does
+		for(auto it = f->indexPieces->begin(); it != f->indexPieces->end(); ++it) {
+			priorities[*it] = top_priority;
+			if(!have[*it])
+				deadlines[*it] = 0;
+		}
+		//Both ends of the file for the subtitle hash, which is only a few pieces
+		//Right away when nothing plays, otherwise after what readers are about to reach
+		for(auto it = f->hashPieces->begin(); it != f->hashPieces->end(); ++it) {
+			if(!nRanges) {
+				priorities[*it] = top_priority;
+				if(!have[*it])
+					deadlines[*it] = 0;
+				continue;
+			}
+			if(priorities[*it] != top_priority)
+				priorities[*it] = default_priority;
+			if(!have[*it] && !deadlines.count(*it))
+				deadlines[*it] = previewDeadlineMs;
+		}
+
+		//To support seeking, we do two things:
+		//- Give deadlines to the next bufferSeconds of playback after each data cursor
+		// // - We determine lowest requested byte, so we can null-prioritize data already skipped
+		long long earliest = infos.fileSize;
+		for(auto it = fileRanges.begin(); it != fileRanges.end(); ++it) {
+			if(it->first < earliest)
+				earliest = it->first;
+			long long rate = it->rate ? it->rate : defaultStreamRate;
+			long long window = bufferWindow(rate, downloadRate);
+			int pieceN = (it->first + infos.offset)/infos.pieceLength;
+			int windowPieces = std::min<long long>((window + infos.pieceLength - 1)/infos.pieceLength, budgetPieces);
+			//A bounded request (a player probing) wants nothing past its end
+			int lastPiece = rangeLastPiece(infos, *it);
+
+			//In streaming mode, only priority 7 is taken in account
+			for(int j = 0; j < windowPieces; ++j) {
+				int pos = j+pieceN;
+				if( pos > lastPiece || pos >= infos.nTotalPieces)
+					break;
+				priorities[pos] = top_priority;
+				if(have[pos])
+					continue;
+
+				//When the reader will get there at its current pace
+				long long distance = (long long)pos*infos.pieceLength - infos.offset - it->first;
+				int deadline = distance > 0 ? (int)(distance * 1000 / rate) : 0;
+				auto d = deadlines.find(pos);
+				if(d == deadlines.end() || d->second > deadline)
+					deadlines[pos] = deadline;
+			}
+		}
+
+		//If no socket is open yet, assume no seeking
+		if(fileRanges.empty())
+			earliest = 0;
+
+		//Seek previews only need a few slices spread across the file
+		for(auto it = f->previews->begin(); it != f->previews->end(); ++it) {
+			int first = (it->first + infos.offset)/infos.pieceLength;
+			int last = (it->second - 1 + infos.offset)/infos.pieceLength;
+			for(int j = first; j <= last && j <= infos.lastPiece && j < infos.nTotalPieces; ++j) {
+				if(priorities[j] == dont_download || priorities[j] == low_priority)
+					priorities[j] = default_priority;
+				if(!have[j] && !deadlines.count(j))
+					deadlines[j] = previewDeadlineMs;
+			}
+		}
+	}
+}
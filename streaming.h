@@ -0,0 +1,77 @@
+// Copyright 2017 Archos SA
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef STREAMING_H
+#define STREAMING_H
+
+#include <list>
+#include <map>
+#include <set>
+#include <vector>
+#include "libtorrent/bitfield.hpp"
+#include "libtorrent/download_priority.hpp"
+#include "libtorrent/units.hpp"
+#include "httpd.h"
+
+struct StreamInfos {
+	int pieceLength;
+	int nTotalPieces;
+	long long offset;
+	int nPieces;
+	int firstPiece;
+	int lastPiece;
+	long long fileSize;
+	const char *path;
+};
+
+//Seconds of playback we want downloaded ahead of each reader
+static const int bufferSeconds = 30;
+//Rate assumed for a reader we haven't measured yet (8Mbps)
+static const long long defaultStreamRate = 1024*1024;
+static const long long minBufferWindow = 4*1024*1024;
+static const long long maxBufferWindow = 512*1024*1024;
+//Preview samples are due right after readers' buffer windows: before bulk data, never before playback
+static const int previewDeadlineMs = bufferSeconds * 1000;
+
+//Bytes to fetch ahead of a reader consuming rate bytes/s
+long long bufferWindow(long long rate, long long downloadRate);
+
+//Pieces each of nRanges readers may have ahead of it with a storageBudget in bytes, LLONG_MAX for no budget
+long long storageBudgetPieces(long long storageBudget, int pieceLength, long long nRanges);
+
+//One past the last byte a reader wants: the end of its range, or of the file
+long long rangeEnd(const StreamInfos& infos, const StreamRange& range);
+//Last piece a reader wants
+int rangeLastPiece(const StreamInfos& infos, const StreamRange& range);
+
+//Everything the priorities of one streamed file depend on
+struct FileDemand {
+	const StreamInfos *infos;
+	//Pieces holding the container's index
+	const std::set<int> *indexPieces;
+	//Pieces the subtitle hash is computed on
+	const std::set<int> *hashPieces;
+	//Where readers are, and how fast they read
+	const std::list<StreamRange> *ranges;
+	//File ranges seek previews wait for
+	const std::vector<std::pair<long long, long long> > *previews;
+};
+
+//Piece priorities for the whole torrent, and deadlines (piece -> ms) for pieces readers will soon need
+//storageBudget is in bytes, 0 for no limit
+void computePriorities(const std::vector<FileDemand>& files, const libtorrent::typed_bitfield<libtorrent::piece_index_t>& have,
+		long long downloadRate, long long storageBudget,
+		std::vector<libtorrent::download_priority_t>& priorities, std::map<int, int>& deadlines);
+
+#endif
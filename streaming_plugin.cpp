@@ -0,0 +1,335 @@
+// Copyright 2017 Archos SA
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/falloc.h>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include "libtorrent/peer_connection_handle.hpp"
+#include "libtorrent/peer_info.hpp"
+#include "log.h"
+#include "streaming_plugin.h"
+#ifdef TORRENTD_EVICTION
+//Not part of libtorrent's public API: torrent and piece_picker are TORRENT_EXTRA_EXPORT,
+//so this links against a static libtorrent, or one built with export-extra=on
+#include "libtorrent/torrent.hpp"
+#include "libtorrent/peer_connection.hpp"
+#include "libtorrent/piece_picker.hpp"
+#endif
+
+using namespace libtorrent;
+
+#ifdef TORRENTD_EVICTION
+struct Eviction {
+	int piece;
+	std::vector<Hole> holes;
+};
+
+static std::mutex _evictions_l;
+static std::map<torrent_handle, std::vector<Eviction> > _evictions;
+
+//Ticks a forgotten piece must go without any peer asking for it before its data is punched out,
+//so that disk reads issued before we forgot it are done
+static const int quietTicksBeforePunch = 2;
+#endif
+
+struct StreamState {
+	std::set<int> urgent;
+	bool nearStall;
+	int connectionsLimit;
+};
+
+static std::mutex _streamStates_l;
+static std::map<torrent_handle, StreamState> _streamStates;
+
+//Peers younger than that haven't had a chance to show their speed yet
+static const int minPeerAgeSeconds = 20;
+//Below that fraction of the median rate, a peer holding urgent blocks is worth dropping
+static const int slowPeerDivisor = 4;
+//Peers with a higher RTT and no payload are considered stuck
+static const int stuckRttMs = 2000;
+//What a peer sends for one request, a piece waits on its slowest block
+static const int blockSize = 16 * 1024;
+//Don't drop too many at once, new peers take a while to get going
+static const int maxDropsPerTick = 2;
+//Never go under that many peers because of us
+static const int minPeers = 4;
+
+#ifdef TORRENTD_EVICTION
+static void punchHole(const Hole& hole) {
+	int fd = open(hole.path.c_str(), O_WRONLY|O_CLOEXEC);
+	if(fd == -1)
+		return;
+	//KEEP_SIZE: the file keeps its layout, only the blocks go back to the filesystem
+	if(fallocate64(fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, hole.offset, hole.size) == -1) {
+		static bool warned = false;
+		if(!warned)
+			LOGW("Can't free space in %s: %s", hole.path.c_str(), strerror(errno));
+		warned = true;
+	}
+	close(fd);
+}
+#endif
+
+//One per peer connection, smoothes what libtorrent reports about it
+class PeerTracker : public peer_plugin {
+	private:
+		peer_connection_handle _pc;
+		std::chrono::steady_clock::time_point _connectedAt;
+	public:
+		//Payload bytes/s, averaged over a few seconds
+		int rate;
+		int rtt;
+		bool snubbed;
+		int downloadingPiece;
+
+		PeerTracker(const peer_connection_handle& pc) : _pc(pc), _connectedAt(std::chrono::steady_clock::now()),
+			rate(0), rtt(0), snubbed(false), downloadingPiece(-1) { }
+
+		void update() {
+			peer_info pi;
+			_pc.get_peer_info(pi);
+			rate = (3 * rate + pi.payload_down_speed) / 4;
+			rtt = pi.rtt;
+			snubbed = (pi.flags & peer_info::snubbed) != 0;
+			downloadingPiece = pi.downloading_piece_index;
+		}
+
+		bool usable() const {
+			return !_pc.is_disconnecting() && !_pc.is_connecting();
+		}
+
+		//How long until its next block gets here: round trip plus transfer, the latter unbounded while it sends nothing
+		long long blockDelayMs() const {
+			return rate > 0 ? rtt + (long long)blockSize * 1000 / rate : LLONG_MAX;
+		}
+
+		int ageSeconds() const {
+			return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - _connectedAt).count();
+		}
+
+#ifdef TORRENTD_EVICTION
+		//Requests for piece we accepted but haven't answered yet
+		bool uploading(int piece) const {
+			auto pc = _pc.native_handle();
+			if(!pc)
+				return false;
+			const auto& queue = pc->upload_queue();
+			for(auto it = queue.begin(); it != queue.end(); ++it) {
+				if(static_cast<int>(it->piece) == piece)
+					return true;
+			}
+			return false;
+		}
+#endif
+
+		//Its blocks go back to the picker, and a connection slot frees up for someone else
+		void drop(errors::error_code_enum reason) {
+			_pc.disconnect(error_code(reason, libtorrent_category()), operation_t::bittorrent);
+		}
+};
+
+class StreamingPlugin : public torrent_plugin {
+	private:
+		torrent_handle _handle;
+#ifdef TORRENTD_EVICTION
+		std::weak_ptr<torrent> _torrent;
+		struct Forgotten {
+			Eviction eviction;
+			int quietTicks;
+		};
+		//Pieces libtorrent forgot, whose data is still on disk
+		std::vector<Forgotten> _forgotten;
+
+		bool uploading(int piece) {
+			for(auto it = _peers.begin(); it != _peers.end(); ++it) {
+				auto peer = it->lock();
+				if(peer && peer->uploading(piece))
+					return true;
+			}
+			return false;
+		}
+#endif
+		std::vector<std::weak_ptr<PeerTracker> > _peers;
+
+		//Close to a stall, the piece under the playhead can't wait for a slow peer to deliver its blocks
+		void balancePeers() {
+			StreamState state;
+			{
+				std::unique_lock<std::mutex> lk(_streamStates_l);
+				auto it = _streamStates.find(_handle);
+				if(it == _streamStates.end())
+					return;
+				state = it->second;
+			}
+
+			std::vector<std::shared_ptr<PeerTracker> > peers;
+			for(auto it = _peers.begin(); it != _peers.end();) {
+				auto peer = it->lock();
+				if(!peer) {
+					it = _peers.erase(it);
+					continue;
+				}
+				++it;
+				if(!peer->usable())
+					continue;
+				peer->update();
+				peers.push_back(peer);
+			}
+			if(!state.nearStall || (int)peers.size() <= minPeers)
+				return;
+
+			std::vector<int> rates;
+			for(auto it = peers.begin(); it != peers.end(); ++it)
+				rates.push_back((*it)->rate);
+			std::nth_element(rates.begin(), rates.begin() + rates.size() / 2, rates.end());
+			int median = rates[rates.size() / 2];
+			auto slow = [median](const PeerTracker& peer) {
+				return peer.snubbed || peer.rate < median / slowPeerDivisor ||
+					(peer.rate == 0 && peer.rtt > stuckRttMs);
+			};
+
+			//Worst first: the ones our urgent blocks would wait the longest for
+			std::sort(peers.begin(), peers.end(), [](const std::shared_ptr<PeerTracker>& a, const std::shared_ptr<PeerTracker>& b) {
+					long long delayA = a->blockDelayMs(), delayB = b->blockDelayMs();
+					return delayA != delayB ? delayA > delayB : a->rtt > b->rtt;
+				});
+
+			//A snubbed or stuck peer may have a decent rate left from before, so every one is looked at
+			int dropped = 0;
+			for(auto it = peers.begin(); it != peers.end() && dropped < maxDropsPerTick; ++it) {
+				PeerTracker& peer = **it;
+				if(!slow(peer) || peer.ageSeconds() < minPeerAgeSeconds || !state.urgent.count(peer.downloadingPiece))
+					continue;
+				LOGD("Dropping slow peer (%d B/s, rtt %d ms) holding urgent piece %d", peer.rate, peer.rtt, peer.downloadingPiece);
+				peer.drop(errors::timed_out);
+				dropped++;
+			}
+
+			//Connection budget used up: make room for a peer that may do better than our slowest
+			if(!dropped && (int)peers.size() >= state.connectionsLimit) {
+				PeerTracker& slowest = *peers.front();
+				if(slowest.ageSeconds() >= minPeerAgeSeconds && slow(slowest)) {
+					LOGD("Rotating out slowest peer (%d B/s, rtt %d ms)", slowest.rate, slowest.rtt);
+					slowest.drop(errors::too_many_connections);
+				}
+			}
+		}
+	public:
+#ifdef TORRENTD_EVICTION
+		StreamingPlugin(const torrent_handle& hdl) : _handle(hdl), _torrent(hdl.native_handle()) { }
+#else
+		StreamingPlugin(const torrent_handle& hdl) : _handle(hdl) { }
+#endif
+
+		~StreamingPlugin() {
+			std::unique_lock<std::mutex> lk(_streamStates_l);
+			_streamStates.erase(_handle);
+		}
+
+		std::shared_ptr<peer_plugin> new_connection(const peer_connection_handle& pc) override {
+			auto peer = std::make_shared<PeerTracker>(pc);
+			_peers.push_back(peer);
+			return peer;
+		}
+
+		//Called once a second from libtorrent's network thread, the only place where touching the picker is safe
+		void tick() override {
+			balancePeers();
+#ifdef TORRENTD_EVICTION
+			evict();
+#endif
+		}
+
+#ifdef TORRENTD_EVICTION
+		//Pieces are forgotten first, so that peers can't ask for them anymore,
+		//then punched once nothing may still be reading them
+		void evict() {
+			std::vector<Eviction> evictions;
+			{
+				std::unique_lock<std::mutex> lk(_evictions_l);
+				auto it = _evictions.find(_handle);
+				if(it != _evictions.end()) {
+					evictions.swap(it->second);
+					_evictions.erase(it);
+				}
+			}
+			if(evictions.empty() && _forgotten.empty())
+				return;
+
+			auto t = _torrent.lock();
+			if(!t)
+				return;
+			//A torrent that has everything may have dropped its picker
+			if(!t->has_picker())
+				t->need_picker();
+
+			for(auto it = _forgotten.begin(); it != _forgotten.end();) {
+				auto stats = t->picker().piece_stats(it->eviction.piece);
+				//Downloaded again meanwhile: the new data must stay
+				if(stats.have || stats.downloading) {
+					it = _forgotten.erase(it);
+					continue;
+				}
+				if(uploading(it->eviction.piece))
+					it->quietTicks = 0;
+				else
+					it->quietTicks++;
+				if(it->quietTicks < quietTicksBeforePunch) {
+					++it;
+					continue;
+				}
+				for(auto hole = it->eviction.holes.begin(); hole != it->eviction.holes.end(); ++hole)
+					punchHole(*hole);
+				it = _forgotten.erase(it);
+			}
+
+			for(auto it = evictions.begin(); it != evictions.end(); ++it) {
+				if(!t->has_piece_passed(it->piece))
+					continue;
+				t->picker().we_dont_have(it->piece);
+				Forgotten f = { *it, 0 };
+				_forgotten.push_back(f);
+			}
+			if(!evictions.empty())
+				t->state_updated();
+		}
+#endif
+};
+
+std::shared_ptr<torrent_plugin> createStreamingPlugin(const torrent_handle& hdl, client_data_t) {
+	return std::make_shared<StreamingPlugin>(hdl);
+}
+
+#ifdef TORRENTD_EVICTION
+void evictPiece(const torrent_handle& hdl, int piece, const std::vector<Hole>& holes) {
+	std::unique_lock<std::mutex> lk(_evictions_l);
+	Eviction e = { piece, holes };
+	_evictions[hdl].push_back(e);
+}
+#endif
+
+void setStreamState(const torrent_handle& hdl, const std::set<int>& urgent, bool nearStall, int connectionsLimit) {
+	std::unique_lock<std::mutex> lk(_streamStates_l);
+	StreamState& state = _streamStates[hdl];
+	state.urgent = urgent;
+	state.nearStall = nearStall;
+	state.connectionsLimit = connectionsLimit;
+}
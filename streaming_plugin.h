@@ -0,0 +1,49 @@
+// Copyright 2017 Archos SA
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef STREAMING_PLUGIN_H
+#define STREAMING_PLUGIN_H
+
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+#include "libtorrent/extensions.hpp"
+#include "libtorrent/torrent_handle.hpp"
+
+//To register with session::add_extension(), lets torrentd act on torrents from libtorrent's thread
+std::shared_ptr<libtorrent::torrent_plugin> createStreamingPlugin(const libtorrent::torrent_handle& hdl, libtorrent::client_data_t);
+
+#ifdef TORRENTD_EVICTION
+//Part of a file to give back to the filesystem once its piece is forgotten
+struct Hole {
+	std::string path;
+	long long offset;
+	long long size;
+};
+
+//Makes libtorrent forget piece, so that it gets downloaded again if wanted, then punches its data out of the files
+//Forgotten on the torrent's next tick, punched a few ticks later once no peer is being sent it
+//The caller must not have a read_piece() pending on it. There's no public API to un-have a piece, this goes through
+//libtorrent's internal piece picker, so it's only built with TORRENTD_EVICTION (see Makefile)
+//Once the piece shows missing in torrent_status, resume data must be saved again
+void evictPiece(const libtorrent::torrent_handle& hdl, int piece, const std::vector<Hole>& holes);
+#endif
+
+//What the plugin needs to know about playback to pick which peers to drop
+//urgent: pieces a reader needs within seconds
+//nearStall: some reader has only a few seconds of data buffered
+//connectionsLimit: connection budget of the session, slow peers are rotated out when it's used up
+void setStreamState(const libtorrent::torrent_handle& hdl, const std::set<int>& urgent, bool nearStall, int connectionsLimit);
+
+#endif
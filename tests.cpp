@@ -0,0 +1,322 @@
+// Copyright 2017 Archos SA
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//Property checks of the pure parts of torrentd: piece availability, priorities and Range parsing
+//Inputs are random but seeded, so that a failure shows up again on the next run
+//Ends with timings of the per-tick code at 1k and 200k pieces
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+#include "availability.h"
+#include "request.h"
+#include "streaming.h"
+
+using namespace libtorrent;
+typedef std::chrono::steady_clock clock_type;
+
+static int _checks = 0;
+static int _failures = 0;
+
+#define CHECK(cond, ...) do { \
+	_checks++; \
+	if(!(cond)) { \
+		if(_failures++ < 20) { \
+			fprintf(stderr, "%s:%d: %s failed: ", __FILE__, __LINE__, #cond); \
+			fprintf(stderr, __VA_ARGS__); \
+			fprintf(stderr, "\n"); \
+		} \
+	} \
+} while(0)
+
+static std::mt19937_64 _rng(1);
+
+static long long randomIn(long long min, long long max) {
+	return std::uniform_int_distribution<long long>(min, max)(_rng);
+}
+
+//A file of a multi-file torrent, with pieces of other files on both sides when there's room
+static StreamInfos randomFile() {
+	StreamInfos infos;
+	infos.pieceLength = 16 * 1024 << randomIn(0, 8);
+	infos.offset = randomIn(0, 20) * infos.pieceLength + randomIn(0, 1) * randomIn(0, infos.pieceLength - 1);
+	infos.fileSize = randomIn(1, 300LL * infos.pieceLength);
+	infos.firstPiece = infos.offset / infos.pieceLength;
+	infos.lastPiece = (infos.offset + infos.fileSize - 1) / infos.pieceLength;
+	infos.nPieces = infos.lastPiece - infos.firstPiece + 1;
+	infos.nTotalPieces = infos.lastPiece + 1 + randomIn(0, 20);
+	infos.path = "test";
+	return infos;
+}
+
+//Bytes readable from off, one piece at a time
+static long long expectedAvailable(const StreamInfos& infos, const std::vector<bool>& have, long long off, long long size) {
+	if(off < 0 || off >= infos.fileSize)
+		return 0;
+	long long end = off;
+	while(end < infos.fileSize && end < off + size && have[(end + infos.offset) / infos.pieceLength])
+		end = std::min(((end + infos.offset) / infos.pieceLength + 1) * infos.pieceLength - infos.offset, infos.fileSize);
+	return std::min(end, off + size) - off;
+}
+
+static void testAvailability() {
+	for(int run = 0; run < 200; ++run) {
+		StreamInfos infos = randomFile();
+		Availability availability(infos.offset, infos.fileSize, infos.pieceLength);
+		std::vector<bool> have(infos.nTotalPieces);
+		for(int op = 0; op < 300; ++op) {
+			//Pieces outside of the file too, they must be ignored
+			int piece = randomIn(std::max(0, infos.firstPiece - 2), infos.nTotalPieces - 1);
+			bool inFile = piece >= infos.firstPiece && piece <= infos.lastPiece;
+			if(randomIn(0, 3)) {
+				availability.add(piece);
+				have[piece] = have[piece] || inFile;
+			} else {
+				availability.remove(piece);
+				have[piece] = false;
+			}
+			CHECK(availability.has(piece) == have[piece], "piece %d", piece);
+
+			long long off = randomIn(-1, infos.fileSize);
+			long long size = randomIn(0, 4LL * infos.pieceLength);
+			long long res = availability.available(off, size);
+			CHECK(res == expectedAvailable(infos, have, off, size), "available(%lld, %lld) = %lld", off, size, res);
+			CHECK(res >= 0 && res <= size && (res == 0 || off + res <= infos.fileSize), "available(%lld, %lld) = %lld", off, size, res);
+		}
+	}
+}
+
+struct Demand {
+	StreamInfos infos;
+	std::set<int> indexPieces;
+	std::set<int> hashPieces;
+	std::list<StreamRange> ranges;
+	std::vector<std::pair<long long, long long> > previews;
+};
+
+static Demand randomDemand() {
+	Demand d;
+	d.infos = randomFile();
+	const StreamInfos& infos = d.infos;
+	for(int i = randomIn(0, 3); i > 0; --i)
+		d.indexPieces.insert(randomIn(infos.firstPiece, infos.lastPiece));
+	d.hashPieces.insert(infos.firstPiece);
+	d.hashPieces.insert(infos.lastPiece);
+	for(int i = randomIn(0, 4); i > 0; --i) {
+		StreamRange r;
+		r.first = randomIn(0, infos.fileSize - 1);
+		r.second = randomIn(0, 1) ? -1 : randomIn(r.first, infos.fileSize - 1);
+		r.rate = randomIn(0, 1) ? 0 : randomIn(1, 20LL * 1024 * 1024);
+		r.idle = randomIn(0, 3) == 0;
+		d.ranges.push_back(r);
+	}
+	for(int i = randomIn(0, 5); i > 0; --i) {
+		long long first = randomIn(0, infos.fileSize - 1);
+		d.previews.push_back(std::make_pair(first, randomIn(first + 1, infos.fileSize)));
+	}
+	return d;
+}
+
+static void compute(Demand& d, const typed_bitfield<piece_index_t>& have, long long downloadRate, long long budget,
+		std::vector<download_priority_t>& priorities, std::map<int, int>& deadlines) {
+	FileDemand f = { &d.infos, &d.indexPieces, &d.hashPieces, &d.ranges, &d.previews };
+	computePriorities(std::vector<FileDemand>(1, f), have, downloadRate, budget, priorities, deadlines);
+}
+
+static void testPriorities() {
+	for(int run = 0; run < 2000; ++run) {
+		Demand d = randomDemand();
+		const StreamInfos& infos = d.infos;
+		typed_bitfield<piece_index_t> have;
+		have.resize(infos.nTotalPieces, false);
+		for(int j = 0; j < infos.nTotalPieces; ++j) {
+			if(randomIn(0, 2) == 0)
+				have.set_bit(j);
+		}
+		long long budget = randomIn(0, 1) ? 0 : randomIn(1, 100LL * infos.pieceLength);
+		std::vector<download_priority_t> priorities;
+		std::map<int, int> deadlines;
+		long long downloadRate = randomIn(0, 10LL * 1024 * 1024);
+		compute(d, have, downloadRate, budget, priorities, deadlines);
+
+		CHECK((int)priorities.size() == infos.nTotalPieces, "%zu priorities for %d pieces", priorities.size(), infos.nTotalPieces);
+		for(int j = 0; j < (int)priorities.size(); ++j) {
+			bool inFile = j >= infos.firstPiece && j <= infos.lastPiece;
+			CHECK(inFile || priorities[j] == dont_download, "piece %d of another file wanted, file is %d-%d", j, infos.firstPiece, infos.lastPiece);
+		}
+		for(auto it = deadlines.begin(); it != deadlines.end(); ++it) {
+			CHECK(it->first >= infos.firstPiece && it->first <= infos.lastPiece, "deadline on piece %d, file is %d-%d", it->first, infos.firstPiece, infos.lastPiece);
+			CHECK(it->first < (int)priorities.size() && priorities[it->first] != dont_download, "deadline on piece %d left at dont_download", it->first);
+			CHECK(!have[it->first], "deadline on piece %d we have", it->first);
+			CHECK(it->second >= 0, "negative deadline %d on piece %d", it->second, it->first);
+		}
+
+		//Idle keep-alive ranges weigh nothing
+		Demand active = d;
+		active.ranges.remove_if([](const StreamRange& r) { return r.idle; });
+		std::vector<download_priority_t> activePriorities;
+		std::map<int, int> activeDeadlines;
+		compute(active, have, downloadRate, budget, activePriorities, activeDeadlines);
+		CHECK(activePriorities == priorities && activeDeadlines == deadlines, "idle ranges changed priorities");
+
+		//While something plays, the subtitle hash waits for what readers are about to reach
+		if(!active.ranges.empty()) {
+			Demand unhashed = d;
+			unhashed.hashPieces.clear();
+			std::vector<download_priority_t> unhashedPriorities;
+			std::map<int, int> unhashedDeadlines;
+			compute(unhashed, have, downloadRate, budget, unhashedPriorities, unhashedDeadlines);
+			for(auto it = d.hashPieces.begin(); it != d.hashPieces.end(); ++it) {
+				auto hashed = deadlines.find(*it);
+				auto before = unhashedDeadlines.find(*it);
+				CHECK(hashed == deadlines.end() || hashed->second >= previewDeadlineMs ||
+					(before != unhashedDeadlines.end() && before->second == hashed->second),
+					"hash piece %d due in %d ms while playing", *it, hashed->second);
+			}
+		}
+
+		//A bounded reader alone gets no deadline past its range
+		if(d.ranges.empty())
+			continue;
+		StreamRange r = d.ranges.front();
+		r.idle = false;
+		d.ranges.assign(1, r);
+		d.indexPieces.clear();
+		d.hashPieces.clear();
+		d.previews.clear();
+		compute(d, have, 0, 0, priorities, deadlines);
+		int last = rangeLastPiece(infos, r);
+		CHECK(deadlines.empty() || deadlines.rbegin()->first <= last, "deadline on piece %d past range %lld-%lld (piece %d)",
+			deadlines.rbegin()->first, r.first, r.second, last);
+
+		//Nor more than the storage budget lets it keep
+		long long budget1 = randomIn(1, 100LL * infos.pieceLength);
+		compute(d, have, 0, budget1, priorities, deadlines);
+		CHECK((long long)deadlines.size() <= storageBudgetPieces(budget1, infos.pieceLength, 1), "%zu deadlines with a budget of %lld pieces",
+			deadlines.size(), storageBudgetPieces(budget1, infos.pieceLength, 1));
+	}
+}
+
+static bool range(const char *header, long long first, long long last) {
+	Token t = { header, (int)strlen(header) };
+	std::pair<long long, long long> res;
+	return parseRange(t, res) && res.first == first && res.second == last;
+}
+
+static bool unsatisfiable(const char *header) {
+	Token t = { header, (int)strlen(header) };
+	std::pair<long long, long long> res;
+	return !parseRange(t, res);
+}
+
+static void testParseRange() {
+	CHECK(range("bytes=0-", 0, -1), "open range");
+	CHECK(range("bytes=5-10", 5, 10), "bounded range");
+	CHECK(range("bytes=5-5", 5, 5), "single byte");
+	CHECK(range("BYTES=1-2", 1, 2), "unit is case insensitive");
+	CHECK(range("bytes=-100", -100, -1), "suffix");
+	CHECK(range("bytes=1-2,5-6", 1, 2), "first of several ranges");
+	CHECK(unsatisfiable("bytes=-0"), "empty suffix");
+	CHECK(unsatisfiable("bytes=10-5"), "inverted range");
+
+	//Malformed: whole file
+	const char *malformed[] = { "", "abc", "bytes=", "bytes=-", "bytes=5", "bytes=x-5", "items=0-5", "bytes 0-5" };
+	for(size_t i = 0; i < sizeof(malformed) / sizeof(malformed[0]); ++i)
+		CHECK(range(malformed[i], 0, -1), "\"%s\"", malformed[i]);
+
+	//Anything else: no crash, and what's accepted is in order
+	const char alphabet[] = "bytes=-0123456789, ";
+	for(int run = 0; run < 100000; ++run) {
+		std::string header = randomIn(0, 1) ? "bytes=" : "";
+		for(int i = randomIn(0, 12); i > 0; --i)
+			header += alphabet[randomIn(0, sizeof(alphabet) - 2)];
+		Token t = { header.data(), (int)header.size() };
+		std::pair<long long, long long> res;
+		if(parseRange(t, res)) {
+			CHECK(res.second == -1 || (res.first >= 0 && res.second >= res.first), "\"%s\" gives %lld-%lld", header.c_str(), res.first, res.second);
+			CHECK(res.first >= 0 || res.second == -1, "\"%s\" gives %lld-%lld", header.c_str(), res.first, res.second);
+		}
+	}
+}
+
+static double usSince(clock_type::time_point start) {
+	return std::chrono::duration<double, std::micro>(clock_type::now() - start).count();
+}
+
+//What torrentd does each tick and for each piece, on a single file of nPieces
+static void timePieces(int nPieces) {
+	Demand d;
+	StreamInfos& infos = d.infos;
+	infos.pieceLength = 256 * 1024;
+	infos.offset = 0;
+	infos.nPieces = infos.nTotalPieces = nPieces;
+	infos.firstPiece = 0;
+	infos.lastPiece = nPieces - 1;
+	infos.fileSize = (long long)nPieces * infos.pieceLength;
+	infos.path = "test";
+	d.hashPieces.insert(0);
+	d.hashPieces.insert(nPieces - 1);
+	d.indexPieces.insert(nPieces - 1);
+	for(int i = 0; i < 4; ++i) {
+		StreamRange r = { infos.fileSize / 4 * i, -1, 2 * 1024 * 1024 };
+		d.ranges.push_back(r);
+	}
+	for(int i = 0; i < 30; ++i)
+		d.previews.push_back(std::make_pair(infos.fileSize / 30 * i, infos.fileSize / 30 * i + 64 * 1024));
+
+	typed_bitfield<piece_index_t> have;
+	have.resize(nPieces, false);
+	for(int j = 0; j < nPieces; j += 2)
+		have.set_bit(j);
+	std::vector<download_priority_t> priorities;
+	std::map<int, int> deadlines;
+	int iterations = std::max(5, 1000000 / nPieces);
+	clock_type::time_point start = clock_type::now();
+	for(int i = 0; i < iterations; ++i)
+		compute(d, have, 5 * 1024 * 1024, 0, priorities, deadlines);
+	double priorityUs = usSince(start) / iterations;
+
+	std::vector<int> order(nPieces);
+	for(int j = 0; j < nPieces; ++j)
+		order[j] = j;
+	std::shuffle(order.begin(), order.end(), _rng);
+	Availability availability(infos.offset, infos.fileSize, infos.pieceLength);
+	start = clock_type::now();
+	for(int j = 0; j < nPieces; ++j)
+		availability.add(order[j]);
+	double addNs = usSince(start) * 1000 / nPieces;
+	long long total = 0;
+	start = clock_type::now();
+	for(int j = 0; j < nPieces; ++j)
+		total += availability.available((long long)order[j] * infos.pieceLength, 1024 * 1024);
+	double availableNs = usSince(start) * 1000 / nPieces;
+	CHECK(total > 0, "nothing available");
+
+	printf("%d pieces: computePriorities %.1f us, Availability::add %.0f ns, Availability::available %.0f ns\n",
+		nPieces, priorityUs, addNs, availableNs);
+}
+
+int main() {
+	testAvailability();
+	testPriorities();
+	testParseRange();
+	timePieces(1000);
+	timePieces(200000);
+	printf("%d checks, %d failed\n", _checks, _failures);
+	return _failures ? 1 : 0;
+}
@@ -16,57 +16,48 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <getopt.h>
+#include <poll.h>
 #include <linux/prctl.h>
 #include <sys/prctl.h>
 #include <iostream>
+#include <sstream>
+#include <string>
 #include <vector>
+#include <map>
+#include <set>
+#include <algorithm>
+#include <thread>
 #include "libtorrent/alert.hpp"
 #include "libtorrent/alert_types.hpp"
 #include "libtorrent/announce_entry.hpp"
 #include "libtorrent/bencode.hpp"
 #include "libtorrent/entry.hpp"
 #include "libtorrent/magnet_uri.hpp"
+#include "libtorrent/read_resume_data.hpp"
 #include "libtorrent/session.hpp"
+#include "libtorrent/session_stats.hpp"
 #include "libtorrent/time.hpp"
 #include "libtorrent/torrent_info.hpp"
 #include "libtorrent/ip_filter.hpp"
+#include "libtorrent/write_resume_data.hpp"
 //#include "libtorrent/extensions/lt_trackers.hpp"
 #include "libtorrent/extensions/smart_ban.hpp"
 #include "libtorrent/extensions/ut_metadata.hpp"
 #include "libtorrent/extensions/ut_pex.hpp"
 
-#ifdef __ANDROID__
-extern "C" {
-ssize_t getline(char **lineptr, size_t *n, FILE *stream)
-{
-	char *ptr;
-	ptr = fgetln(stream, n);
-	if (ptr == NULL) {
-		return -1;
-	}
-	/* Free the original ptr */
-	if (*lineptr != NULL) free(*lineptr);
-	/* Add one more space for '\0' */
-	size_t len = n[0] + 1;
-	/* Update the length */
-	n[0] = len;
-	/* Allocate a new buffer */
-	*lineptr = (char*) malloc(len);
-	/* Copy over the string */
-	memcpy(*lineptr, ptr, len-1);
-	/* Write the NULL character */
-	(*lineptr)[len-1] = '\0';
-	/* Return the length of the new buffer */
-	return len;
-}
-};
-#endif
-
+#include "blocklist.h"
+#include "container.h"
+#include "httpd.h"
+#include "log.h"
+#include "streaming.h"
+#include "streaming_plugin.h"
 
 using namespace libtorrent;
-extern void start_httpd();
-extern void setFileInfos(const char *filePath, long long fileSize, std::function<long long (long long, long long)>);
-extern std::list<std::pair<long long, long long> > getRanges();
 
 static session* _myLibtorrentSession;
 session* s() {
@@ -87,14 +78,32 @@ void end(int sig) {
 	int fd = open(".ses_state", O_WRONLY|O_CREAT, 0644);
 	write(fd, &out[0], out.size());
 	close(fd);
-	std::cerr << "Saved state" << std::endl;
+	LOGI("Saved state");
+	flushLogger();
 	_exit(1);
 }
 
+//Set from signal handlers, the event loop does the actual shutdown
+static volatile sig_atomic_t _quit = 0;
+
+static void requestEnd(int sig) {
+	(void)sig;
+	_quit = 1;
+}
+
+//Offline measurements against local seeders: no discovery, no trackers, only the peers given with -p
+static bool _localTest = false;
+static std::vector<boost::asio::ip::tcp::endpoint> _localPeers;
+
+static const int connectionsLimit = 50;
+
+//Web seeds given with -w, for the torrent given on the command line
+static std::vector<std::string> _webSeeds;
+
 static void setup() {
 	auto pack = s()->get_settings();
 
-	pack.set_int(settings_pack::connections_limit, 50);
+	pack.set_int(settings_pack::connections_limit, connectionsLimit);
 	pack.set_int(settings_pack::upload_rate_limit, 200*1024);
 	pack.set_int(settings_pack::request_timeout, 20);
 	pack.set_str(settings_pack::dht_bootstrap_nodes,
@@ -109,8 +118,18 @@ static void setup() {
 	pack.set_bool(settings_pack::enable_upnp, true);
 	pack.set_bool(settings_pack::enable_lsd, true);
 	pack.set_bool(settings_pack::enable_dht, true);
+	if(_localTest) {
+		pack.set_str(settings_pack::listen_interfaces, "127.0.0.1:0");
+		pack.set_bool(settings_pack::enable_natpmp, false);
+		pack.set_bool(settings_pack::enable_upnp, false);
+		pack.set_bool(settings_pack::enable_lsd, false);
+		pack.set_bool(settings_pack::enable_dht, false);
+		//All seeders share 127.0.0.1
+		pack.set_bool(settings_pack::allow_multiple_connections_per_ip, true);
+	}
 	// pack.set_int(settings_pack::alert_mask, 0x7fffffff);
-        pack.set_int(settings_pack::alert_mask, alert::error_notification);
+        //piece_progress lets us wake up HTTP readers as soon as a piece is verified
+        pack.set_int(settings_pack::alert_mask, alert_category::error | alert_category::status | alert_category::piece_progress | alert_category::storage);
 
 	s()->apply_settings(pack);
 }
@@ -128,11 +147,11 @@ static int init_torrentd() {
 
 			bdecode_node e = bdecode(in, ec);
 			if(ec) {
-				fprintf(stderr, "failed loading saved state: %s\n", ec.message().c_str());
+				LOGW("failed loading saved state: %s", ec.message().c_str());
 			} else {
-				std::cerr << "Loading saved state..." << std::endl;
+				LOGI("Loading saved state...");
                                 auto params = read_session_params(in);
-                                if(_myLibtorrentSession) std::cerr << "Can't restore session because it is already started" << std::endl;
+                                if(_myLibtorrentSession) LOGW("Can't restore session because it is already started");
                                 _myLibtorrentSession = new session(params);
                         }
                         close(loadFd);
@@ -142,43 +161,446 @@ static int init_torrentd() {
 	s()->add_extension(&libtorrent::create_ut_metadata_plugin);
 	s()->add_extension(&libtorrent::create_ut_pex_plugin);
 	s()->add_extension(&libtorrent::create_smart_ban_plugin);
+	s()->add_extension(&createStreamingPlugin);
 
 	setup();
 
 	return 0;
 }
 
-static void load_blocklist(char *path) {
-	FILE* filter = fopen("blocklist", "r");
-	if(!filter)
+//Runs in its own thread, so that the torrent starts without waiting for it
+static void load_blocklist(const char *path) {
+	IpRanges ranges;
+	if(!loadBlocklist(path, ".blocklist.cache", ranges))
 		return;
 
 	ip_filter fil;
-	char *line = NULL;
-	size_t len = 0;
+	for(auto it = ranges.begin(); it != ranges.end(); ++it)
+		fil.add_rule(address_v4(it->first), address_v4(it->second), ip_filter::blocked);
 
-	while(getline(&line, &len, filter)>=0) {
-		char *str = strchr(line, ':');
-		if(!str)
-			continue;
-		str++;
-		unsigned int a,b,c,d,e,f,g,h;
-		if(sscanf(str, "%u.%u.%u.%u-%u.%u.%u.%u", &a, &b, &c, &d, &e, &f, &g, &h) != 8)
+	s()->set_ip_filter(fil);
+	LOGI("Blocklist: %zu ranges", ranges.size());
+}
+
+//One file being streamed
+struct StreamedFile {
+	int fileId;
+	StreamInfos infos;
+	IndexSearch indexSearch;
+	std::set<int> indexPieces;
+	//Pieces holding what the subtitle hash is computed on
+	std::set<int> hashPieces;
+	bool subtitleHashDone;
+	//Keyframes were handed to httpd, or there's none to find
+	bool keyframesDone;
+};
+
+struct Torrent {
+	torrent_handle handle;
+	//Hex info-hash, used in HTTP paths and control commands
+	std::string id;
+	//Torrent given on the command line: its files are listed and its status reported on stdout
+	bool primary;
+	bool filesListed;
+	//Primary torrent's files were listed, and the app hasn't picked one yet
+	bool awaitingSelection;
+	int nTrackers;
+	std::map<int, StreamedFile> files;
+	//Asked for before metadata was there
+	std::set<int> pendingFiles;
+	//Piece -> deadline we gave it, so that we can drop deadlines once readers moved on
+	std::map<int, int> deadlines;
+	//What libtorrent was last told, to only send changes
+	std::vector<download_priority_t> priorities;
+	//Kept around to avoid reallocating it every second
+	std::vector<download_priority_t> nextPriorities;
+	std::vector<long long> priorityInputs;
+	//Latest state_update_alert, to reprioritize between two of them when a reader seeks
+	torrent_status status;
+	bool hasStatus;
+	//Handed to the streaming plugin, but maybe not forgotten by libtorrent yet
+	std::set<int> evicting;
+	//read_piece() requests not answered yet, their pieces can't be evicted
+	std::set<int> reading;
+	//Bumped each time a piece is gained or evicted, priorities depend on which pieces we have
+	long long piecesVersion;
+	//HTTP mirrors (BEP 19), only attached while a reader is about to stall
+	std::vector<std::string> webSeeds;
+	bool webSeedsAttached;
+	time_point healthySince;
+};
+
+static std::map<torrent_handle, Torrent> _torrents;
+
+static Torrent* findTorrent(const torrent_handle& hdl) {
+	auto it = _torrents.find(hdl);
+	if(it == _torrents.end())
+		return NULL;
+	return &it->second;
+}
+
+static Torrent* findTorrent(const std::string& id) {
+	for(auto it = _torrents.begin(); it != _torrents.end(); ++it) {
+		if(it->second.id == id)
+			return &it->second;
+	}
+	return NULL;
+}
+
+static std::string torrentId(const torrent_handle& hdl) {
+	std::stringstream ss;
+	ss << hdl.info_hashes().get_best();
+	return ss.str();
+}
+
+//Fast-resume data, one file per torrent, so that a restart doesn't hash again what's already on disk
+static const char *resumeDir = ".resume";
+//How often torrents with new pieces get their resume data saved, in ms
+static const int resumeInterval = 60*1000;
+//save_resume_data requests not answered yet
+static int _pendingResume = 0;
+
+static std::string resumePath(const std::string& id) {
+	return std::string(resumeDir) + "/" + id + ".fastresume";
+}
+
+//Write to a temporary file first, so that being killed mid-way never leaves a truncated file
+static bool writeFileAtomic(const std::string& path, const std::vector<char>& data) {
+	std::string tmp = path + ".tmp";
+	int fd = open(tmp.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if(fd == -1)
+		return false;
+	size_t done = 0;
+	while(done < data.size()) {
+		int res = write(fd, &data[done], data.size() - done);
+		if(res <= 0)
+			break;
+		done += res;
+	}
+	bool ok = done == data.size() && fsync(fd) == 0;
+	close(fd);
+	if(!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+		unlink(tmp.c_str());
+		return false;
+	}
+	return true;
+}
+
+static bool readFile(const std::string& path, std::vector<char>& data) {
+	int fd = open(path.c_str(), O_RDONLY);
+	if(fd == -1)
+		return false;
+	struct stat st;
+	bool ok = fstat(fd, &st) == 0;
+	if(ok) {
+		data.resize(st.st_size);
+		ok = st.st_size == 0 || pread(fd, &data[0], st.st_size, 0) == st.st_size;
+	}
+	close(fd);
+	return ok;
+}
+
+static void requestResumeData(const torrent_handle& hdl, resume_data_flags_t flags) {
+	//Keep the info dict, so that a torrent added by magnet doesn't wait for metadata again
+	hdl.save_resume_data(flags | torrent_handle::save_info_dict);
+	_pendingResume++;
+}
+
+static void saveResumeDataPeriodically() {
+	for(auto it = _torrents.begin(); it != _torrents.end(); ++it) {
+		if(it->second.handle.need_save_resume_data())
+			requestResumeData(it->second.handle, {});
+	}
+}
+
+//Returns true if the alert was a reply to save_resume_data
+static bool handleResumeAlert(alert *a) {
+	if (save_resume_data_alert* p = alert_cast<save_resume_data_alert>(a)) {
+		_pendingResume--;
+		//Mirrors are only attached around stalls, the next run would otherwise start with them
+		Torrent *t = findTorrent(p->handle);
+		if(t) {
+			auto& seeds = p->params.url_seeds;
+			for(auto it = t->webSeeds.begin(); it != t->webSeeds.end(); ++it)
+				seeds.erase(std::remove(seeds.begin(), seeds.end(), *it), seeds.end());
+		}
+		std::string path = resumePath(torrentId(p->handle));
+		if(!writeFileAtomic(path, write_resume_data_buf(p->params)))
+			LOGE("Failed writing %s: %s", path.c_str(), strerror(errno));
+		return true;
+	} else if (save_resume_data_failed_alert* p = alert_cast<save_resume_data_failed_alert>(a)) {
+		_pendingResume--;
+		LOGW("Failed saving resume data: %s", p->error.message().c_str());
+		return true;
+	}
+	return false;
+}
+
+//Swap p for what we saved last time this torrent ran, if anything
+static void loadResumeData(add_torrent_params& p) {
+	sha1_hash hash;
+	if(p.ti)
+		hash = p.ti->info_hashes().get_best();
+	else if(!p.info_hashes.get_best().is_all_zeros())
+		hash = p.info_hashes.get_best();
+	else
+		return;
+
+	std::stringstream ss;
+	ss << hash;
+	std::vector<char> data;
+	if(!readFile(resumePath(ss.str()), data))
+		return;
+
+	error_code ec;
+	add_torrent_params resumed = read_resume_data(data, ec);
+	if(ec) {
+		LOGW("Ignoring resume data for %s: %s", ss.str().c_str(), ec.message().c_str());
+		return;
+	}
+	if(!resumed.ti)
+		resumed.ti = p.ti;
+	//The command line or magnet gives the same trackers on every run, and they were saved last time
+	//Copies left by earlier runs go too. Tiers are listed in parallel, missing ones being tier 0
+	std::vector<std::string> trackers;
+	std::vector<int> tiers;
+	for(int from = 0; from < 2; ++from) {
+		const add_torrent_params& params = from ? p : resumed;
+		for(size_t i = 0; i < params.trackers.size(); ++i) {
+			if(std::find(trackers.begin(), trackers.end(), params.trackers[i]) != trackers.end())
+				continue;
+			trackers.push_back(params.trackers[i]);
+			tiers.push_back(i < params.tracker_tiers.size() ? params.tracker_tiers[i] : 0);
+		}
+	}
+	resumed.trackers.swap(trackers);
+	resumed.tracker_tiers.swap(tiers);
+	//Written before mirrors were left out of it
+	for(auto it = _webSeeds.begin(); it != _webSeeds.end(); ++it)
+		resumed.url_seeds.erase(std::remove(resumed.url_seeds.begin(), resumed.url_seeds.end(), *it), resumed.url_seeds.end());
+	resumed.save_path = p.save_path;
+	p = std::move(resumed);
+	LOGI("Loaded resume data for %s", ss.str().c_str());
+}
+
+//Info dictionaries of torrents added by magnet, saved as soon as peers sent them
+//Resume data has them too, but only once it's saved, which a crash or a kill can prevent
+static const char *metadataDir = ".metadata";
+
+static std::string metadataPath(const std::string& id) {
+	return std::string(metadataDir) + "/" + id + ".torrent";
+}
+
+static void saveMetadata(const torrent_handle& hdl) {
+	auto ti = hdl.torrent_file();
+	if(!ti)
+		return;
+	auto info = ti->info_section();
+	static const char prefix[] = "d4:info";
+	std::vector<char> data(prefix, prefix + strlen(prefix));
+	data.insert(data.end(), info.begin(), info.end());
+	data.push_back('e');
+
+	std::string path = metadataPath(torrentId(hdl));
+	if(!writeFileAtomic(path, data))
+		LOGE("Failed writing %s: %s", path.c_str(), strerror(errno));
+}
+
+//Use the info dictionary we already have for a magnet, so that files can be picked right away
+static void loadMetadata(add_torrent_params& p) {
+	if(p.ti || p.info_hashes.get_best().is_all_zeros())
+		return;
+	std::stringstream ss;
+	ss << p.info_hashes.get_best();
+	std::string path = metadataPath(ss.str());
+	if(access(path.c_str(), R_OK))
+		return;
+
+	error_code ec;
+	auto ti = std::make_shared<torrent_info>(path, ec);
+	if(ec || ti->info_hashes().get_best() != p.info_hashes.get_best()) {
+		LOGW("Ignoring cached metadata for %s", ss.str().c_str());
+		unlink(path.c_str());
+		return;
+	}
+	p.ti = ti;
+	LOGI("Loaded cached metadata for %s", ss.str().c_str());
+}
+
+//Flush resume data of every torrent, then save session state and exit
+static void shutdown() {
+	for(auto it = _torrents.begin(); it != _torrents.end(); ++it) {
+		if(it->second.handle.is_valid())
+			requestResumeData(it->second.handle, torrent_handle::flush_disk_cache);
+	}
+
+	//Don't let a stuck disk keep us from exiting when the app wants us gone
+	time_point start = clock_type::now();
+	while(_pendingResume > 0 && clock_type::now() - start < std::chrono::seconds(5)) {
+		if(!s()->wait_for_alert(milliseconds(500)))
 			continue;
+		std::vector<alert*> alerts;
+		s()->pop_alerts(&alerts);
+		for(auto alert: alerts)
+			handleResumeAlert(alert);
+	}
+	end(0);
+}
 
-		address_v4 start((a << 24) + (b << 16) + (c << 8) + d);
-		address_v4 last((e << 24) + (f << 16) + (g << 8) + h);
-		fil.add_rule(start, last, ip_filter::blocked);
+static const char *savePath = "./";
+//Bytes of downloaded pieces to keep on disk, 0 for no limit
+static long long _storageBudget = 0;
+
+static bool readFileData(const Torrent& t, const StreamedFile& f, long long off, void *buf, int len) {
+	if(off < 0 || off + len > f.infos.fileSize || availableData(t.id, f.fileId, off, len) < len)
+		return false;
+	int fd = open(f.infos.path, O_RDONLY);
+	if(fd == -1)
+		return false;
+	int res = pread64(fd, buf, len, off);
+	close(fd);
+	return res == len;
+}
+
+//Locate the container index (mp4 moov, mkv Cues) as soon as the headers leading to it are there,
+//and fetch it before anything else, so that the player needs a single round of seeks to start
+static void updateIndexPieces(Torrent& t, StreamedFile& f) {
+	const StreamInfos& infos = f.infos;
+	f.indexSearch = findContainerIndex(infos.fileSize, [&](long long off, void *buf, int len) {
+			return readFileData(t, f, off, buf, len);
+		});
+
+	for(auto it = f.indexSearch.wanted.begin(); it != f.indexSearch.wanted.end(); ++it) {
+		int first = (it->first + infos.offset) / infos.pieceLength;
+		int last = (std::min(it->second, infos.fileSize) - 1 + infos.offset) / infos.pieceLength;
+		for(int j = first; j <= last && j < infos.nTotalPieces; ++j) {
+			if(f.indexPieces.count(j))
+				continue;
+			f.indexPieces.insert(j);
+			t.handle.piece_priority(j, top_priority);
+			t.handle.set_piece_deadline(j, 0);
+			if((size_t)j < t.priorities.size())
+				t.priorities[j] = top_priority;
+			t.deadlines[j] = 0;
+		}
 	}
+	LOGI("Container index: %zu ranges, %zu pieces%s", f.indexSearch.wanted.size(),
+		f.indexPieces.size(), f.indexSearch.done ? "" : ", still looking");
+}
 
-	s()->set_ip_filter(fil);
-	fclose(filter);
+static bool wantedByIndexSearch(const StreamedFile& f, int piece) {
+	long long start = (long long)piece * f.infos.pieceLength - f.infos.offset;
+	long long end = start + f.infos.pieceLength;
+	for(auto it = f.indexSearch.wanted.begin(); it != f.indexSearch.wanted.end(); ++it) {
+		if(it->first < end && it->second > start)
+			return true;
+	}
+	return false;
+}
+
+//Parse keyframes once the container index is downloaded, so that /preview requests don't have to
+static void updateKeyframes(Torrent& t, StreamedFile& f) {
+	if(f.keyframesDone || !f.indexSearch.done)
+		return;
+	for(auto it = f.indexSearch.wanted.begin(); it != f.indexSearch.wanted.end(); ++it) {
+		long long end = std::min(it->second, f.infos.fileSize);
+		if(availableData(t.id, f.fileId, it->first, end - it->first) < end - it->first)
+			return;
+	}
+	auto keyframes = findKeyframes(f.infos.fileSize, [&](long long off, void *buf, int len) {
+			return readFileData(t, f, off, buf, len);
+		});
+	f.keyframesDone = true;
+	setKeyframes(t.id, f.fileId, keyframes);
+	LOGI("Keyframes of %s: %zu", f.infos.path, keyframes.size());
+}
+
+//Bytes hashed at each end of the file by the OpenSubtitles hash
+static const long long subtitleHashChunk = 64*1024;
+
+//OpenSubtitles hash: file size plus every little-endian 64bits word of the first and last 64KiB
+//Handed to httpd once both ends are downloaded, so that the app gets it without fetching anything
+static void updateSubtitleHash(Torrent& t, StreamedFile& f) {
+	if(f.subtitleHashDone)
+		return;
+	long long size = f.infos.fileSize;
+	int len = std::min(subtitleHashChunk, size);
+	std::vector<uint8_t> head(len), tail(len);
+	if(!readFileData(t, f, 0, head.data(), len) || !readFileData(t, f, size - len, tail.data(), len))
+		return;
+
+	uint64_t hash = size;
+	for(int i = 0; i + 8 <= len; i += 8) {
+		uint64_t a = 0, b = 0;
+		for(int j = 7; j >= 0; --j) {
+			a = (a << 8) | head[i + j];
+			b = (b << 8) | tail[i + j];
+		}
+		hash += a + b;
+	}
+	f.subtitleHashDone = true;
+	setSubtitleHash(t.id, f.fileId, hash);
+	LOGI("Subtitle hash of %s: %016llx", f.infos.path, (unsigned long long)hash);
+}
+
+//Start streaming a file, torrent metadata must be there
+static void selectFile(Torrent& t, int fileId) {
+	auto st = t.handle.status(torrent_handle::query_pieces | torrent_handle::query_torrent_file);
+	auto torrentInfo = st.torrent_file.lock();
+	if(!torrentInfo || !torrentInfo->is_valid()) {
+		t.pendingFiles.insert(fileId);
+		return;
+	}
+	auto files = torrentInfo->files();
+	if(fileId < 0 || fileId >= files.num_files()) {
+		LOGW("No file %d in %s", fileId, t.id.c_str());
+		return;
+	}
+	if(t.files.count(fileId))
+		return;
+
+	StreamedFile& f = t.files[fileId];
+	f.fileId = fileId;
+	f.indexSearch = IndexSearch();
+	StreamInfos& infos = f.infos;
+
+	infos.pieceLength = torrentInfo->piece_length();
+	infos.nTotalPieces = torrentInfo->num_pieces();
+
+	infos.offset = files.file_offset(fileId);
+	infos.nPieces = (files.file_size(fileId) + infos.pieceLength - 1)/infos.pieceLength;
+	infos.firstPiece = infos.offset/infos.pieceLength;
+	infos.fileSize = files.file_size(fileId);
+	infos.lastPiece = (infos.offset + infos.fileSize)/infos.pieceLength;
+	infos.path = strdup(files.file_path(fileId).c_str());
+
+	//From now on, httpd is kept up to date piece by piece
+	setFileInfos(t.id, fileId, infos.path, infos.fileSize, infos.offset, infos.pieceLength);
+	for(int j = infos.firstPiece; j <= infos.lastPiece && j < infos.nTotalPieces; ++j) {
+		if(st.pieces[j])
+			setPieceAvailable(t.id, j, true);
+	}
+	updateIndexPieces(t, f);
+
+	long long hashed = std::min(subtitleHashChunk, infos.fileSize);
+	long long ends[][2] = {
+		{ infos.offset, infos.offset + hashed },
+		{ infos.offset + infos.fileSize - hashed, infos.offset + infos.fileSize },
+	};
+	for(int e = 0; e < 2 && hashed; ++e) {
+		for(long long j = ends[e][0] / infos.pieceLength; j <= (ends[e][1] - 1) / infos.pieceLength && j < infos.nTotalPieces; ++j)
+			f.hashPieces.insert(j);
+	}
+	f.subtitleHashDone = false;
+	updateSubtitleHash(t, f);
+	f.keyframesDone = false;
+	updateKeyframes(t, f);
 }
 
 static void add_torrent(const char* torrent) {
 	error_code ec;
 	add_torrent_params p;
-	p.save_path = "./";
+	p.save_path = savePath;
 
     //This one is if "torrent" is a local file
 	p.ti.reset(new torrent_info(torrent, ec));
@@ -191,62 +613,723 @@ static void add_torrent(const char* torrent) {
 
 		//Try to parse it as a magnet
 		parse_magnet_uri(torrent, p, ec);
+		if(!ec)
+			loadMetadata(p);
+	}
+	loadResumeData(p);
+	//Local tests talk to -p peers only, drop trackers before the torrent gets a chance to announce
+	if(_localTest) {
+		p.trackers.clear();
+		p.tracker_tiers.clear();
+		if(p.ti)
+			p.ti->clear_trackers();
 	}
 
 	s()->async_add_torrent(p);
 }
 
+static void remove_torrent(Torrent& t) {
+	torrent_handle hdl = t.handle;
+	removeFiles(t.id);
+	s()->remove_torrent(hdl);
+	_torrents.erase(hdl);
+}
+
+//Commands from the app, one per line on stdin
+static std::string _controlBuffer;
+static bool _controlEof = false;
+
+//Returns false when there's no complete line yet (or ever, once stdin is closed)
+static bool readControlLine(std::string& line) {
+	while(1) {
+		size_t eol = _controlBuffer.find('\n');
+		if(eol != std::string::npos) {
+			line = _controlBuffer.substr(0, eol);
+			_controlBuffer.erase(0, eol + 1);
+			if(!line.empty() && line[line.size()-1] == '\r')
+				line.erase(line.size()-1);
+			return true;
+		}
+		if(_controlEof)
+			return false;
+
+		struct pollfd pfd;
+		pfd.fd = 0;
+		pfd.events = POLLIN;
+		if(poll(&pfd, 1, 0) <= 0)
+			return false;
+
+		char buf[512];
+		int n = read(0, buf, sizeof(buf));
+		if(n <= 0) {
+			_controlEof = true;
+			return false;
+		}
+		_controlBuffer.append(buf, n);
+	}
+}
+
+//add <torrent url or magnet>
+//remove <torrent>
+//select <torrent> <fileIndex>
+//webseed <torrent> <url>
+//<fileIndex>, answering the primary torrent's file list
+static void handleCommand(const std::string& line) {
+	std::istringstream in(line);
+	std::string cmd, arg;
+	in >> cmd >> arg;
+
+	if(cmd == "add" && !arg.empty()) {
+		add_torrent(arg.c_str());
+	} else if(cmd == "remove") {
+		Torrent *t = findTorrent(arg);
+		if(t)
+			remove_torrent(*t);
+	} else if(cmd == "select") {
+		int fileId = -1;
+		in >> fileId;
+		Torrent *t = findTorrent(arg);
+		if(t)
+			selectFile(*t, fileId);
+	} else if(cmd == "webseed") {
+		std::string url;
+		in >> url;
+		Torrent *t = findTorrent(arg);
+		if(t && !url.empty() && std::find(t->webSeeds.begin(), t->webSeeds.end(), url) == t->webSeeds.end()) {
+			t->webSeeds.push_back(url);
+			if(t->webSeedsAttached)
+				t->handle.add_url_seed(url);
+		}
+	} else if(!cmd.empty() && arg.empty() && std::all_of(cmd.begin(), cmd.end(), ::isdigit)) {
+		//Legacy answer to the primary torrent's file list
+		for(auto it = _torrents.begin(); it != _torrents.end(); ++it) {
+			Torrent& t = it->second;
+			if(!t.primary || !t.awaitingSelection)
+				continue;
+			t.awaitingSelection = false;
+			selectFile(t, atoi(cmd.c_str()));
+		}
+	} else if(!line.empty()) {
+		LOGW("Unknown command %s", line.c_str());
+	}
+}
+
+//How many of the largest videos get their header and trailer fetched before the app picks one
+static const int maxPrefetchCandidates = 3;
+//Bytes fetched at each end: mkv/mp4 headers, and the index most muxers put at the end
+static const long long prefetchBytes = 1024*1024;
+
+static bool isVideo(const std::string& path) {
+	static const char *extensions[] = { ".mkv", ".mp4", ".m4v", ".avi", ".mov", ".webm", ".ts", ".wmv", ".mpg", ".mpeg", ".flv" };
+	size_t dot = path.rfind('.');
+	if(dot == std::string::npos)
+		return false;
+	std::string ext = path.substr(dot);
+	std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+	for(size_t j = 0; j < sizeof(extensions)/sizeof(extensions[0]); ++j) {
+		if(ext == extensions[j])
+			return true;
+	}
+	return false;
+}
+
+//While the app decides, fetch both ends of the files it's most likely to pick,
+//so that the container index of the chosen one is there when it starts
+//Everything else waits: what updatePriorities will ask for isn't known yet
+static void prefetchCandidates(Torrent& t, std::shared_ptr<const torrent_info> torrentInfo) {
+	auto files = torrentInfo->files();
+	std::vector<std::pair<long long, int> > candidates;
+	for(int j = 0; j < files.num_files(); ++j) {
+		if(isVideo(files.file_path(j)))
+			candidates.push_back(std::make_pair(files.file_size(j), j));
+	}
+	if(candidates.empty()) {
+		for(int j = 0; j < files.num_files(); ++j)
+			candidates.push_back(std::make_pair(files.file_size(j), j));
+	}
+	std::sort(candidates.rbegin(), candidates.rend());
+	if((int)candidates.size() > maxPrefetchCandidates)
+		candidates.resize(maxPrefetchCandidates);
+
+	int pieceLength = torrentInfo->piece_length();
+	int nPieces = torrentInfo->num_pieces();
+	t.priorities.assign(nPieces, dont_download);
+	for(auto c = candidates.begin(); c != candidates.end(); ++c) {
+		long long offset = files.file_offset(c->second);
+		long long size = c->first;
+		if(!size)
+			continue;
+		long long ends[][2] = {
+			{ offset, offset + std::min(size, prefetchBytes) },
+			{ offset + size - std::min(size, prefetchBytes), offset + size },
+		};
+		for(int e = 0; e < 2; ++e) {
+			for(long long j = ends[e][0] / pieceLength; j <= (ends[e][1] - 1) / pieceLength && j < nPieces; ++j)
+				t.priorities[j] = top_priority;
+		}
+		LOGD("Prefetching both ends of %s", files.file_path(c->second).c_str());
+	}
+	t.handle.prioritize_pieces(t.priorities);
+}
+
+//List files, the app then picks one through the control channel
+static void listFiles(Torrent& t, std::shared_ptr<const torrent_info> torrentInfo) {
+	auto files = torrentInfo->files();
+	auto trackers = torrentInfo->trackers();
+	t.nTrackers = trackers.size();
+	t.filesListed = true;
+	setTorrent(t.id, files.num_files());
+
+	if(!t.primary) {
+		for(int j=0; j<files.num_files(); ++j)
+			std::cout << "file " << t.id << " " << j << " " << files.file_path(j) << std::endl;
+		for(auto it = t.pendingFiles.begin(); it != t.pendingFiles.end(); ++it)
+			selectFile(t, *it);
+		t.pendingFiles.clear();
+		if(t.files.empty())
+			prefetchCandidates(t, torrentInfo);
+		return;
+	}
+
+	for(int j=0; j<files.num_files(); ++j) {
+		std::cout << files.file_path(j) << std::endl;
+	}
+	//Empty line to mark end of list
+	std::cout << std::endl;
+	LOGI("More than one file, which one to take ?");
+	//The answer is a bare file number, handled with the other commands
+	t.awaitingSelection = true;
+	prefetchCandidates(t, torrentInfo);
+}
+
+static void updatePriorities(Torrent& t, const torrent_status& st) {
+	//Everything the result depends on, nothing to do if it's the same as last time
+	std::map<int, std::list<StreamRange> > ranges;
+	std::map<int, std::vector<std::pair<long long, long long> > > previews;
+	std::vector<long long> inputs;
+	inputs.push_back(t.piecesVersion);
+	for(auto f = t.files.begin(); f != t.files.end(); ++f) {
+		auto& fileRanges = ranges[f->first];
+		//Please note that streaming mode is on
+		//So early pieces are prefered by default
+		fileRanges = getRanges(t.id, f->first);
+		inputs.push_back(f->first);
+		inputs.push_back(f->second.indexPieces.size());
+		for(auto it = fileRanges.begin(); it != fileRanges.end(); ++it) {
+			long long rate = it->rate ? it->rate : defaultStreamRate;
+			inputs.push_back(it->first);
+			inputs.push_back(it->idle);
+			inputs.push_back(rate);
+			inputs.push_back(bufferWindow(rate, st.download_payload_rate));
+		}
+		auto& filePreviews = previews[f->first];
+		filePreviews = getPreviews(t.id, f->first);
+		inputs.push_back(filePreviews.size());
+		for(auto it = filePreviews.begin(); it != filePreviews.end(); ++it)
+			inputs.push_back(it->first);
+	}
+	if(inputs == t.priorityInputs)
+		return;
+	t.priorityInputs.swap(inputs);
+
+	//Compute pieces priorities
+	std::vector<FileDemand> demands;
+	for(auto f = t.files.begin(); f != t.files.end(); ++f) {
+		FileDemand d = { &f->second.infos, &f->second.indexPieces, &f->second.hashPieces, &ranges[f->first], &previews[f->first] };
+		demands.push_back(d);
+	}
+	std::vector<download_priority_t>& priorities = t.nextPriorities;
+	//piece -> deadline in ms, the closest one when several readers want it
+	std::map<int, int> deadlines;
+	computePriorities(demands, st.pieces, st.download_payload_rate, _storageBudget, priorities, deadlines);
+
+	//Now that we have computed priorities, tell libtorrent about what changed
+	//Each call makes libtorrent go through its piece picker, which is slow on big torrents
+	if(t.priorities.size() != priorities.size()) {
+		t.handle.prioritize_pieces(priorities);
+	} else {
+		std::vector<std::pair<piece_index_t, download_priority_t> > changes;
+		for(size_t j = 0; j < priorities.size(); ++j) {
+			if(priorities[j] != t.priorities[j])
+				changes.push_back(std::make_pair(piece_index_t(j), priorities[j]));
+		}
+		if(!changes.empty())
+			t.handle.prioritize_pieces(changes);
+	}
+	t.priorities.swap(priorities);
+
+	for(auto d = deadlines.begin(); d != deadlines.end(); ++d) {
+		auto previous = t.deadlines.find(d->first);
+		if(previous == t.deadlines.end() || previous->second != d->second)
+			t.handle.set_piece_deadline(d->first, d->second);
+	}
+	for(auto p = t.deadlines.begin(); p != t.deadlines.end(); ++p) {
+		if(!deadlines.count(p->first) && !st.pieces[p->first])
+			t.handle.reset_piece_deadline(p->first);
+	}
+	t.deadlines.swap(deadlines);
+}
+
+//Under that many seconds of playback buffered, a reader is about to stall
+static const int stallSeconds = 5;
+//How long readers must stay fed before web seeds are let go
+static const int webSeedHoldSeconds = 15;
+
+//Mirrors serve what the deadline picker asks first, so attaching them when a reader is about to stall
+//gets the pieces under the playhead over HTTP, while bulk data keeps coming from the swarm
+static void updateWebSeeds(Torrent& t, bool nearStall) {
+	if(t.webSeeds.empty())
+		return;
+	if(nearStall) {
+		t.healthySince = clock_type::now();
+		if(t.webSeedsAttached)
+			return;
+		LOGI("Reader about to stall, using %zu web seeds", t.webSeeds.size());
+		for(auto it = t.webSeeds.begin(); it != t.webSeeds.end(); ++it)
+			t.handle.add_url_seed(*it);
+		t.webSeedsAttached = true;
+	} else if(t.webSeedsAttached && clock_type::now() - t.healthySince > std::chrono::seconds(webSeedHoldSeconds)) {
+		LOGI("Readers fed again, dropping web seeds");
+		for(auto it = t.webSeeds.begin(); it != t.webSeeds.end(); ++it)
+			t.handle.remove_url_seed(*it);
+		t.webSeedsAttached = false;
+	}
+}
+
+//Tell the streaming plugin which pieces are urgent, and whether a reader is about to stall
+static void updateStreamState(Torrent& t, const torrent_status& st) {
+	std::set<int> urgent;
+	for(auto d = t.deadlines.begin(); d != t.deadlines.end(); ++d) {
+		if(d->second < stallSeconds * 1000 && !st.pieces[d->first])
+			urgent.insert(d->first);
+	}
+
+	bool nearStall = false;
+	for(auto f = t.files.begin(); f != t.files.end() && !nearStall; ++f) {
+		auto fileRanges = getRanges(t.id, f->first);
+		for(auto it = fileRanges.begin(); it != fileRanges.end(); ++it) {
+			if(it->idle)
+				continue;
+			long long rate = it->rate ? it->rate : defaultStreamRate;
+			long long needed = std::min(rate * stallSeconds, rangeEnd(f->second.infos, *it) - it->first);
+			if(needed > 0 && availableData(t.id, f->first, it->first, needed) < needed) {
+				nearStall = true;
+				break;
+			}
+		}
+	}
+	setStreamState(t.handle, urgent, nearStall, connectionsLimit);
+	updateWebSeeds(t, nearStall);
+}
+
+//Hand libtorrent counters over to /metrics
+static void publishSessionStats(session_stats_alert *p) {
+	static const std::vector<stats_metric> metrics = session_stats_metrics();
+	auto values = p->counters();
+
+	std::vector<SessionCounter> counters;
+	counters.reserve(metrics.size());
+	for(auto m = metrics.begin(); m != metrics.end(); ++m) {
+		SessionCounter c;
+		c.name = m->name;
+		c.value = values[m->value_index];
+		c.gauge = m->type == metric_type_t::gauge;
+		counters.push_back(c);
+	}
+	setSessionStats(counters);
+}
+
+#ifdef TORRENTD_EVICTION
+//Pieces behind every reader go first, the ones furthest behind first,
+//then those furthest ahead of the closest reader before them
+static long long evictionScore(int piece, const std::vector<int>& playheads) {
+	if(playheads.empty() || piece < playheads.front())
+		return (1LL << 32) + (playheads.empty() ? 0 : playheads.front()) - piece;
+	auto it = std::upper_bound(playheads.begin(), playheads.end(), piece);
+	--it;
+	return piece - *it;
+}
+
+//With -b, keep downloaded data under _storageBudget by forgetting pieces readers are unlikely to need soon
+static void enforceStorageBudget() {
+	if(!_storageBudget)
+		return;
+
+	struct Candidate {
+		long long score;
+		Torrent *torrent;
+		int piece;
+		bool operator<(const Candidate& o) const { return score > o.score; }
+	};
+	std::vector<Candidate> candidates;
+	long long used = 0;
+	long long kept = 0;
+
+	//The budget is shared by every reader, like computePriorities() does
+	std::map<std::pair<Torrent*, int>, std::list<StreamRange> > ranges;
+	long long nRanges = 0;
+	for(auto it = _torrents.begin(); it != _torrents.end(); ++it) {
+		for(auto f = it->second.files.begin(); f != it->second.files.end(); ++f) {
+			auto& fileRanges = ranges[std::make_pair(&it->second, f->first)];
+			fileRanges = getRanges(it->second.id, f->first);
+			for(auto r = fileRanges.begin(); r != fileRanges.end(); ++r)
+				nRanges += !r->idle;
+		}
+	}
+
+	for(auto it = _torrents.begin(); it != _torrents.end(); ++it) {
+		Torrent& t = it->second;
+		if(!t.hasStatus || t.files.empty())
+			continue;
+		const torrent_status& st = t.status;
+		int pieceLength = t.files.begin()->second.infos.pieceLength;
+
+		bool evicted = false;
+		for(auto p = t.evicting.begin(); p != t.evicting.end();) {
+			if(!st.pieces[*p]) {
+				p = t.evicting.erase(p);
+				evicted = true;
+			} else {
+				++p;
+			}
+		}
+		//libtorrent forgot those pieces, the .fastresume must too, or they'd be trusted after a restart
+		if(evicted) {
+			requestResumeData(t.handle, {});
+			t.piecesVersion++;
+		}
+		used += (long long)(st.num_pieces - t.evicting.size()) * pieceLength;
+
+		//Never evicted: headers, index and subtitle hash, and what's about to be read,
+		//the latter no more than each reader's share of the budget
+		std::set<int> protect;
+		for(auto f = t.files.begin(); f != t.files.end(); ++f) {
+			const StreamInfos& infos = f->second.infos;
+			protect.insert(f->second.indexPieces.begin(), f->second.indexPieces.end());
+			protect.insert(f->second.hashPieces.begin(), f->second.hashPieces.end());
+			protect.insert(infos.firstPiece);
+			protect.insert(infos.lastPiece);
+
+			std::vector<int> playheads;
+			auto& fileRanges = ranges[std::make_pair(&t, f->first)];
+			long long budgetPieces = storageBudgetPieces(_storageBudget, infos.pieceLength, nRanges);
+			for(auto r = fileRanges.begin(); r != fileRanges.end(); ++r) {
+				if(r->idle)
+					continue;
+				int pieceN = (r->first + infos.offset)/infos.pieceLength;
+				long long rate = r->rate ? r->rate : defaultStreamRate;
+				long long windowPieces = std::min<long long>((bufferWindow(rate, st.download_payload_rate) + infos.pieceLength - 1)/infos.pieceLength,
+					std::max(0LL, budgetPieces - 2));
+				//Players often step back a little, keep the piece before too
+				for(long long j = pieceN - 1; j <= std::min<long long>(pieceN + windowPieces, rangeLastPiece(infos, *r)); ++j)
+					protect.insert(j);
+				playheads.push_back(pieceN);
+			}
+			std::sort(playheads.begin(), playheads.end());
+
+			for(int j = infos.firstPiece; j <= infos.lastPiece && j < infos.nTotalPieces; ++j) {
+				if(!st.pieces[j] || t.evicting.count(j))
+					continue;
+				if(protect.count(j) || t.reading.count(j)) {
+					kept += pieceLength;
+					continue;
+				}
+				Candidate c = { evictionScore(j, playheads), &t, j };
+				candidates.push_back(c);
+			}
+		}
+	}
+
+	//A bit of slack, so that we don't evict one piece each time one arrives
+	long long target = _storageBudget / 10 * 9;
+	if(used <= _storageBudget)
+		return;
+	std::sort(candidates.begin(), candidates.end());
+
+	for(auto c = candidates.begin(); c != candidates.end() && used > target; ++c) {
+		Torrent& t = *c->torrent;
+		auto torrentInfo = t.status.torrent_file.lock();
+		if(!torrentInfo)
+			continue;
+		auto files = torrentInfo->files();
+		int size = torrentInfo->piece_size(c->piece);
+
+		std::vector<Hole> holes;
+		auto slices = files.map_block(c->piece, 0, size);
+		for(auto slice = slices.begin(); slice != slices.end(); ++slice) {
+			Hole h = { files.file_path(slice->file_index, savePath), slice->offset, slice->size };
+			holes.push_back(h);
+		}
+		//Stop serving it before its data goes away
+		setPieceAvailable(t.id, c->piece, false);
+		evictPiece(t.handle, c->piece, holes);
+		t.evicting.insert(c->piece);
+		used -= size;
+	}
+	if(used > target)
+		LOGW("Storage: %lld bytes used, %lld of them needed by readers, over budget %lld", used, kept, _storageBudget);
+	else
+		LOGD("Storage: %lld bytes used, budget %lld", used, _storageBudget);
+}
+#else
+//Forgetting pieces needs libtorrent internals, see Makefile
+//Without it, -b only keeps priorities from going further ahead of readers than the budget
+static void enforceStorageBudget() {
+}
+#endif
+
+//A reader opened, moved or closed a range: don't wait for next status update to follow it
+static void rangesChanged() {
+	uint64_t count;
+	read(rangesChangedFd(), &count, sizeof(count));
+	//Players may ask for files the app didn't select
+	auto requests = takeFileRequests();
+	for(auto it = requests.begin(); it != requests.end(); ++it) {
+		Torrent *t = findTorrent(it->first);
+		if(t)
+			selectFile(*t, it->second);
+	}
+	for(auto it = _torrents.begin(); it != _torrents.end(); ++it) {
+		if(it->second.hasStatus && !it->second.files.empty())
+			updatePriorities(it->second, it->second.status);
+	}
+}
+
+//Written from libtorrent's thread when alerts are waiting, so that one poll() covers alerts, readers and commands
+static int _alertFd = -1;
+
+static void alertsPending() {
+	uint64_t one = 1;
+	write(_alertFd, &one, sizeof(one));
+}
+
+static void reportStatus(Torrent& t, const torrent_status& st) {
+	auto& hdl = t.handle;
+	int nPeers = st.list_peers;
+	if(nPeers == 0) {
+		if(t.nTrackers == 0) {
+			nPeers = -1;
+		} else if(st.current_tracker == "") {
+			nPeers = -2;
+		}
+	}
+
+	if(t.primary) {
+		std::cout
+			<< st.num_peers << ";"
+			<< nPeers << ";"
+			<< st.download_rate << ";"
+			<< (hdl.flags() & torrent_flags::seed_mode) << ";"
+			<< st.total_wanted_done << ";"
+			<< st.total_wanted << ";"
+			<< st.distributed_full_copies << std::endl;
+	}
+
+#ifndef NDEBUG
+	long long cacheHits, cacheMisses, cacheBytes;
+	getCacheStats(cacheHits, cacheMisses, cacheBytes);
+	LOGD("%s:%s:%d:%lld\n\tpeers = %d/%d\n\tcache = %lld hits, %lld misses, %lldkB",
+		st.name.c_str(), t.id.c_str(),
+		(bool)(hdl.flags() & torrent_flags::sequential_download),
+		(long long)st.total_payload_download/1024,
+		st.num_peers, nPeers,
+		cacheHits, cacheMisses, cacheBytes/1024);
+	for(auto f = t.files.begin(); f != t.files.end(); ++f) {
+		const StreamInfos& infos = f->second.infos;
+		LOGD("\tfile %d\n\t\tfileSize = %lld\n\t\tnTotalPieces = %d\n\t\tfirstPiece = %d\n\t\tlastPiece = %d\n\t\toffset = %lld\n\t\tfileNPieces = %d",
+			f->first, infos.fileSize, infos.nTotalPieces, infos.firstPiece,
+			infos.lastPiece, infos.offset, infos.nPieces);
+	}
+#endif
+}
+
 int main(int argc, char* argv[])
 {
-	if(argc<=2) {
-		std::cerr << argv[0] << ": <torrent url or magnet> <pathtoblocklist>" << std::endl;
+	int opt;
+	int httpPort = 0;
+	while((opt = getopt(argc, argv, "c:b:lp:H:w:")) != -1) {
+		switch(opt) {
+			case 'c':
+				setCacheSize(atoll(optarg) * 1024 * 1024);
+				break;
+			case 'b':
+				_storageBudget = atoll(optarg) * 1024 * 1024;
+#ifndef TORRENTD_EVICTION
+				LOGW("Built without TORRENTD_EVICTION: -b limits what's fetched ahead, downloaded pieces are kept");
+#endif
+				break;
+			case 'l':
+				_localTest = true;
+				break;
+			case 'p': {
+				//ip:port of a peer to connect to
+				const char *colon = strrchr(optarg, ':');
+				boost::system::error_code ec;
+				auto addr = colon ? boost::asio::ip::make_address(std::string(optarg, colon - optarg), ec) : address();
+				if(!colon || ec) {
+					std::cerr << "Invalid peer " << optarg << std::endl;
+					argc = 0;
+					break;
+				}
+				_localPeers.push_back(boost::asio::ip::tcp::endpoint(addr, atoi(colon + 1)));
+				break;
+			}
+			case 'H':
+				httpPort = atoi(optarg);
+				break;
+			case 'w':
+				_webSeeds.push_back(optarg);
+				break;
+			default:
+				argc = 0;
+				break;
+		}
+	}
+	if(argc - optind < 2) {
+		std::cerr << argv[0] << ": [-c <piece cache MB>] [-b <storage budget MB>] [-l] [-p <peer ip:port>]... [-H <http port>] [-w <web seed url>]... <torrent url or magnet> <pathtoblocklist>" << std::endl;
+		std::cerr << "\t-l: local test, no DHT, UPnP, NAT-PMP, LSD or trackers" << std::endl;
 		exit(1);
 	}
 
+	startLogger();
 	if(init_torrentd())
 		return 1;
 
 	//If parent dies, we get a SIGHUP
 	prctl(PR_SET_PDEATHSIG, SIGHUP);
-	signal(SIGINT, end);
-	signal(SIGHUP, end);
+	signal(SIGINT, requestEnd);
+	signal(SIGHUP, requestEnd);
+	signal(SIGTERM, requestEnd);
 	signal(SIGPIPE, SIG_IGN);
-	start_httpd();
-
-	load_blocklist(argv[2]);
-
-	add_torrent(argv[1]);
-
-	int fileId = -1;
-
-	struct {
-		int pieceLength;
-		int nTotalPieces;
-		long long offset;
-		int nPieces;
-		int firstPiece;
-		int lastPiece;
-		long long fileSize;
-		const char *path;
-		int nTrackers;
-	} infos;
-	
+	start_httpd(httpPort);
+
+	std::thread(load_blocklist, argv[optind+1]).detach();
+
+	add_torrent(argv[optind]);
+	bool primaryAdded = false;
+
+	mkdir(resumeDir, 0755);
+	mkdir(metadataDir, 0755);
+
+	_alertFd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	s()->set_alert_notify(alertsPending);
+
+	time_point lastUpdate = clock_type::now();
+	time_point lastResume = clock_type::now();
+
 	//Event loop
-	while(1) {
-		if(!s()->wait_for_alert(milliseconds(1000))) {
+	while(!_quit) {
+		std::string line;
+		while(readControlLine(line))
+			handleCommand(line);
+
+		//Status updates are still wanted once a second, even when piece alerts keep us busy
+		auto sinceUpdate = std::chrono::duration_cast<std::chrono::milliseconds>(clock_type::now() - lastUpdate).count();
+		if(sinceUpdate >= 1000) {
 			s()->post_torrent_updates();
-			continue;
+			s()->post_session_stats();
+			lastUpdate = clock_type::now();
+			sinceUpdate = 0;
+		}
+		if(clock_type::now() - lastResume >= milliseconds(resumeInterval)) {
+			saveResumeDataPeriodically();
+			lastResume = clock_type::now();
 		}
 
+		struct pollfd fds[3];
+		fds[0].fd = _alertFd;
+		fds[1].fd = rangesChangedFd();
+		fds[2].fd = _controlEof ? -1 : 0;
+		for(int j = 0; j < 3; ++j) {
+			fds[j].events = POLLIN;
+			fds[j].revents = 0;
+		}
+		if(poll(fds, 3, 1000 - sinceUpdate) <= 0)
+			continue;
+		if(fds[1].revents & POLLIN)
+			rangesChanged();
+		if(!(fds[0].revents & POLLIN))
+			continue;
+		uint64_t count;
+		read(_alertFd, &count, sizeof(count));
+
 		std::vector<alert*> alerts;
 		s()->pop_alerts(&alerts);
 		for(auto alert: alerts) {
-			if (state_update_alert* p = alert_cast<state_update_alert>(alert)) {
+			if(handleResumeAlert(alert))
+				continue;
+			if (piece_finished_alert* p = alert_cast<piece_finished_alert>(alert)) {
+				Torrent *t = findTorrent(p->handle);
+				if(!t || t->files.empty())
+					continue;
+				//Publish right away instead of waiting for next status update
+				setPieceAvailable(t->id, p->piece_index, true);
+				//Downloaded again before the eviction showed up in a status
+				t->evicting.erase(p->piece_index);
+				t->piecesVersion++;
+				bool hot = t->deadlines.count(p->piece_index);
+				for(auto f = t->files.begin(); f != t->files.end(); ++f) {
+					if(!f->second.indexSearch.done && wantedByIndexSearch(f->second, p->piece_index))
+						updateIndexPieces(*t, f->second);
+					if(f->second.indexPieces.count(p->piece_index))
+						updateKeyframes(*t, f->second);
+					if(f->second.hashPieces.count(p->piece_index))
+						updateSubtitleHash(*t, f->second);
+					hot = hot || f->second.indexPieces.count(p->piece_index);
+				}
+				//Readers are about to ask for it, keep it in RAM
+				if(hot) {
+					p->handle.read_piece(p->piece_index);
+					t->reading.insert(p->piece_index);
+				}
+			} else if (read_piece_alert* p = alert_cast<read_piece_alert>(alert)) {
+				Torrent *t = findTorrent(p->handle);
+				if(!t)
+					continue;
+				t->reading.erase(p->piece);
+				if(p->error) {
+					LOGW("Failed reading piece %d: %s", (int)p->piece, p->error.message().c_str());
+					continue;
+				}
+				//Keep the alert's buffer alive for as long as the cache needs it
+				boost::shared_array<char> buffer = p->buffer;
+				cachePiece(t->id, p->piece, std::shared_ptr<const char>(buffer.get(), [buffer](const char*) {}), p->size);
+			} else if (metadata_received_alert* p = alert_cast<metadata_received_alert>(alert)) {
+				saveMetadata(p->handle);
+			} else if (session_stats_alert* p = alert_cast<session_stats_alert>(alert)) {
+				publishSessionStats(p);
+			} else if (add_torrent_alert* p = alert_cast<add_torrent_alert>(alert)) {
+				if(p->error) {
+					LOGE("Failed adding torrent: %s", p->error.message().c_str());
+					continue;
+				}
+				Torrent& t = _torrents[p->handle];
+				t.handle = p->handle;
+				t.id = torrentId(p->handle);
+				setTorrent(t.id, -1);
+				t.primary = !primaryAdded;
+				t.filesListed = false;
+				t.awaitingSelection = false;
+				t.webSeedsAttached = false;
+				if(t.primary)
+					t.webSeeds = _webSeeds;
+				t.hasStatus = false;
+				t.nTrackers = 0;
+				t.piecesVersion = 0;
+				primaryAdded = true;
+				for(auto it = _localPeers.begin(); it != _localPeers.end(); ++it)
+					p->handle.connect_peer(*it);
+				if(!t.primary)
+					std::cout << "torrent " << t.id << std::endl;
+			} else if (state_update_alert* p = alert_cast<state_update_alert>(alert)) {
 				for (std::vector<torrent_status>::iterator i = p->status.begin();
 						i != p->status.end(); ++i) {
+					Torrent *t = findTorrent(i->handle);
+					if(!t)
+						continue;
 					auto torrentInfo = i->torrent_file.lock();
-					if(!torrentInfo->is_valid()) {
-						std::cerr << "Torrent not valid yet" << std::endl;
+					if(!torrentInfo || !torrentInfo->is_valid()) {
+						LOGD("Torrent not valid yet");
 						continue;
 					}
 					auto& hdl = i->handle;
@@ -258,155 +1341,25 @@ int main(int argc, char* argv[])
 					// One-time tasks:
 					// - Find fileId
 					// - Retrieve static torrent infos
-					if(fileId == -1) {
-						auto files = torrentInfo->files();
-						for(int j=0; j<files.num_files(); ++j) {
-							std::cout << files.file_path(j) << std::endl;
-						}
-						//Empty line to mark end of list
-						std::cout << std::endl;
-						std::cerr << "More than one file, which one to take ?" << std::endl;
-						std::cin >> fileId;
-
-						infos.pieceLength = torrentInfo->piece_length();
-						infos.nTotalPieces = torrentInfo->num_pieces();
-
-						infos.offset = files.file_offset(fileId);
-						infos.nPieces = (files.file_size(fileId) + infos.pieceLength - 1)/infos.pieceLength;
-						infos.firstPiece = infos.offset/infos.pieceLength;
-						infos.fileSize = files.file_size(fileId);
-						infos.lastPiece = (infos.offset + infos.fileSize)/infos.pieceLength;
-						infos.path = strdup(files.file_path(fileId).c_str());
-
-						auto trackers = torrentInfo->trackers();
-						infos.nTrackers = trackers.size();
-					}
+					if(!t->filesListed)
+						listFiles(*t, torrentInfo);
 
-					//Compute pieces priorities
-					std::vector<download_priority_t> priorities(infos.nTotalPieces, dont_download);
-					//Please note that streaming mode is on
-					//So early pieces are prefered by default
-					auto ranges = getRanges();
-
-					//Set all pieces in the file to default priority
-					for(int j = infos.firstPiece;
-							j<= infos.lastPiece && j <infos.nTotalPieces;
-							++j)
-						priorities[j] = low_priority;
-					//We will most likely need the end of the file
-					//Either because of mkv/mp4, or to fingerprint subtitles
-					if(infos.lastPiece >= infos.nTotalPieces) {
-						std::cerr << "lastPiece >= TotalPieces" << std::endl;
-					} else {
-						priorities[infos.lastPiece] = top_priority;
+					t->status = *i;
+					t->hasStatus = true;
+					if(!t->files.empty()) {
+						updatePriorities(*t, *i);
+						updateStreamState(*t, *i);
 					}
 
-					//To support seeking, we do two things:
-					//- Highly prioritize 10MB around current data cursor
-					// // - We determine lowest requested byte, so we can null-prioritize data already skipped
-					long long earliest = infos.fileSize;
-					for(auto it = ranges.begin(); it != ranges.end(); ++it) {
-						if(it->first < earliest)
-							earliest = it->first;
-						int TenMB_in_pieces = (10*1024*1024)/infos.pieceLength;
-						if(!TenMB_in_pieces)
-							TenMB_in_pieces = 1;
-						int pieceN = (it->first + infos.offset)/infos.pieceLength;
-
-						//Ask for 10MB max priority
-						//In streaming mode, only priority 7 is taken in account
-						for(int j = 0; j < TenMB_in_pieces; ++j) {
-							int pos = j+pieceN;
-							if( pos > infos.lastPiece)
-								break;
-							priorities[pos] = top_priority;
-						}
-					}
-
-					//If no socket is open yet, assume no seeking
-					if(ranges.empty())
-						earliest = 0;
-
-					//Now that we have computed priorities, tell libtorrent about it
-					i->handle.prioritize_pieces(priorities);
-
-					int nPeers = i->list_peers;
-					if(nPeers == 0) {
-						if(infos.nTrackers == 0) {
-							nPeers = -1;
-						} else if(i->current_tracker == "") {
-							nPeers = -2;
-						}
-					}
-
-					std::cout
-						<< i->num_peers << ";"
-						<< nPeers << ";"
-						<< i->download_rate << ";"
-						<< (hdl.flags() & torrent_flags::seed_mode) << ";"
-						<< i->total_wanted_done << ";"
-						<< i->total_wanted << ";"
-						<< i->distributed_full_copies << std::endl;
-
-
-					std::cerr << i->name
-						<< ":" << (hdl.flags() & torrent_flags::sequential_download)
-						<< ":" << (i->total_payload_download/1024)
-						<< "/" << (infos.fileSize/1024)
-						<< "\n\tfileSize = " << infos.fileSize
-						<< "\n\tnTotalPieces = " << infos.nTotalPieces
-						<< "\n\tfirstPiece = " << infos.firstPiece
-						<< "\n\tlastPiece = " << infos.lastPiece
-						<< "\n\toffset = " << infos.offset
-						<< "\n\tfileNPieces = " << infos.nPieces
-						<< std::endl;
-
-						bitfield pieces = i->pieces;
-						setFileInfos(infos.path, infos.fileSize, [=](long long off, long long size) -> long long {
-								//Piece number of the start of $off in file
-								int start = (off + infos.offset) / infos.pieceLength;
-
-								long long res = 0;
-								if(!pieces[start])
-									return 0;
-
-								// Since we have current piece, we can at least read what's left from current offset to the end of the piece
-								res = infos.pieceLength - ( (off + infos.offset ) %infos.pieceLength);
-
-								// Now count how many (full) pieces we can still get from here.
-								int pos = start+1;
-								while(res < size) {
-									//We're beyond current file, stop here
-									if(pos > infos.lastPiece)
-										break;
-
-									// Next piece isn't available, that's all we can read
-									if(!pieces[pos])
-										break;
-
-									// If we arrived at the last piece, we managed to get all the pieces of the file, so we can read everything
-									if(pos == infos.lastPiece) {
-										res = infos.fileSize - off;
-										break;
-									}
-
-									// Got one more piece to read
-									res += infos.pieceLength;
-									++pos;
-								}
-
-								if(res>size)
-									res = size;
-								return res;
-							});
+					reportStatus(*t, *i);
 				}
+				enforceStorageBudget();
 			} else {
-				std::cerr << alert->message() << std::endl;
+				LOGI("%s", alert->message().c_str());
 			}
 		}
 	}
 
-	end(0);
+	shutdown();
 	return 0;
 }
-